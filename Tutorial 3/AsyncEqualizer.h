@@ -0,0 +1,110 @@
+#pragma once
+
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+
+#include "Equalizer.h"
+
+//images kept in flight by the -async batch mode
+const size_t ASYNC_IN_FLIGHT = 8;
+
+//equalises images without blocking the caller: Submit enqueues the whole pipeline and returns a future
+//that is fulfilled from the completion callback of the final read (clSetEventCallback), so any number of
+//images can be in flight and the host thread only waits when it asks a future for its result
+//Submit may be called from several threads, the completion callbacks run on a runtime thread
+class AsyncEqualizer {
+public:
+	AsyncEqualizer(const cl::Context& context, const cl::Program& program, bool out_of_order = false, const TuningProfile& profile = TuningProfile()) :
+		queue(context, GetQueueProperties(context, out_of_order)),
+		kernels(program, profile),
+		pool(context) {}
+
+	//every submitted image completes before the equaliser goes away
+	~AsyncEqualizer() {
+		queue.finish();
+		std::unique_lock<std::mutex> lock(mutex);
+		idle.wait(lock, [this]() { return pending == 0; });
+	}
+
+	//'events', if given, receives the profiling events of the kernels, which are complete once the future is ready
+	std::future<CImg<unsigned char>> Submit(const CImg<unsigned char>& image, EqualizerEvents* events = NULL) {
+		//owned by the completion callback once it is registered
+		std::unique_ptr<Job> job(new Job());
+		job->owner = this;
+		job->input = image;
+		job->output.assign(image.width(), image.height(), image.depth(), image.spectrum());
+		std::future<CImg<unsigned char>> result = job->promise.get_future();
+		size_t image_size = image.size();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		job->buffers.Reserve(pool, image_size);
+
+		TaskGraph::Node uploaded = job->graph.Add("upload", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+			queue.enqueueWriteBuffer(job->buffers.imageInput, CL_FALSE, 0, image_size, job->input.data(), wait, done);
+		});
+		TaskGraph::Node computed = EnqueueEqualize(job->graph, queue, kernels, job->buffers, image_size, { uploaded }, job->events);
+		if (events)
+			*events = job->events;
+		TaskGraph::Node downloaded = job->graph.Add("download", { computed }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+			queue.enqueueReadBuffer(job->buffers.imageOutput, CL_FALSE, 0, image_size, job->output.data(), wait, done);
+		});
+
+		//counted before the callback exists and registered without the lock, as a runtime may run the callback
+		//from within setCallback when the read has already completed (and Complete takes the lock)
+		cl::Event done = job->graph.GetEvent(downloaded);
+		pending++;
+		lock.unlock();
+
+		Job* owned = job.release();
+		try {
+			done.setCallback(CL_COMPLETE, &AsyncEqualizer::Complete, owned);
+		}
+		catch (const cl::Error& err) {
+			//nothing else would fulfil the future or release the buffers, which must not go back to the pool
+			//while the read may still use them (the C call, as a failed read must not throw here)
+			clWaitForEvents(1, &done());
+			Complete(done(), err.err(), owned);
+		}
+		queue.flush();
+
+		return result;
+	}
+
+private:
+	struct Job {
+		AsyncEqualizer* owner;
+		CImg<unsigned char> input;
+		CImg<unsigned char> output;
+		EqualizerBuffers buffers;
+		EqualizerEvents events;
+		TaskGraph graph;
+		std::promise<CImg<unsigned char>> promise;
+	};
+
+	//runs once the final read has completed (or failed), the buffers go back to the pool for the next image
+	static void CL_CALLBACK Complete(cl_event, cl_int status, void* user_data) {
+		Job* job = (Job*)user_data;
+		AsyncEqualizer* owner = job->owner;
+
+		if (status == CL_COMPLETE)
+			job->promise.set_value(std::move(job->output));
+		else
+			job->promise.set_exception(std::make_exception_ptr(cl::Error(status, "AsyncEqualizer")));
+
+		//notified under the lock, once it is released the destructor may return and the owner be gone
+		std::lock_guard<std::mutex> lock(owner->mutex);
+		job->buffers.Release(owner->pool);
+		delete job;
+		owner->pending--;
+		owner->idle.notify_all();
+	}
+
+	cl::CommandQueue queue;
+	EqualizerKernels kernels;
+	BufferPool pool;
+	std::mutex mutex; //guards the kernels' arguments, the pool and 'pending'
+	std::condition_variable idle;
+	size_t pending = 0;
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "Equalizer.h"
+
+//tuned configurations of every device seen so far, one line per device and kernel:
+//device name <TAB> kernel <TAB> local size <TAB> coarsening
+const char* TUNING_PROFILE_FILE = "tuning_profiles.txt";
+
+//coarsening factors tried for every local size
+const int TUNING_COARSENING[] = { 1, 2, 4, 8, 16, 32 };
+
+//launches per candidate, the fastest one is kept to filter out noise
+const int TUNING_REPETITIONS = 3;
+
+//read the profile of 'device' from 'file_name', returns false if the device has not been tuned yet
+bool LoadTuningProfile(const string& file_name, const string& device, TuningProfile& profile) {
+	ifstream file(file_name);
+	string line;
+	bool found = false;
+
+	while (getline(file, line)) {
+		stringstream fields(line);
+		string name, kernel, local_size, coarsening;
+		if (!getline(fields, name, '\t') || !getline(fields, kernel, '\t') || !getline(fields, local_size, '\t') || !getline(fields, coarsening))
+			continue;
+		if (name != device)
+			continue;
+
+		KernelConfig config;
+		config.localSize = strtoull(local_size.c_str(), NULL, 10);
+		config.coarsening = std::max(1, atoi(coarsening.c_str()));
+
+		if (kernel == "histogram") { profile.histogram = config; found = true; }
+		else if (kernel == "backProjection") { profile.backProjection = config; found = true; }
+	}
+
+	return found;
+}
+
+//replace the entries of 'device' in 'file_name', keeping the profiles of other devices
+void SaveTuningProfile(const string& file_name, const string& device, const TuningProfile& profile) {
+	vector<string> lines;
+	{
+		ifstream file(file_name);
+		string line;
+		while (getline(file, line)) {
+			if (line.compare(0, device.size() + 1, device + "\t") != 0)
+				lines.push_back(line);
+		}
+	}
+
+	ofstream file(file_name, ios::trunc);
+	for (const string& line : lines)
+		file << line << endl;
+	file << device << "\thistogram\t" << profile.histogram.localSize << "\t" << profile.histogram.coarsening << endl;
+	file << device << "\tbackProjection\t" << profile.backProjection.localSize << "\t" << profile.backProjection.coarsening << endl;
+}
+
+//sweep local sizes (multiples of the preferred multiple up to the limit of the kernel, see KernelLimits) and coarsening factors
+//of the histogram and back projection kernels on a calibration image and return the fastest configuration of each
+//the untuned launch with the default local size is measured too and kept if nothing beats it
+TuningProfile Autotune(const cl::Context& context, const cl::Program& program, const CImg<unsigned char>& calibration, ostream& log) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+	EqualizerKernels kernels(program);
+	EqualizerBuffers buffers;
+	size_t size = calibration.size();
+
+	//a complete untuned run leaves a valid LUT for the back projection candidates
+	buffers.Reserve(context, size);
+	queue.enqueueWriteBuffer(buffers.imageInput, CL_TRUE, 0, size, calibration.data());
+	TaskGraph graph;
+	EqualizerEvents events;
+	EnqueueEqualize(graph, queue, kernels, buffers, size, {}, events);
+	graph.Wait();
+
+	//time one candidate of one stage, setting it in the kernels' profile
+	auto measure = [&](KernelConfig& stage, const KernelConfig& candidate) {
+		stage = candidate;
+		cl_ulong best = ~(cl_ulong)0;
+		for (int r = 0; r < TUNING_REPETITIONS; r++) {
+			TaskGraph timing;
+			TaskGraph::Node node = (&stage == &kernels.profile.histogram) ?
+				EnqueueHistogram(timing, queue, kernels, buffers.imageInput, buffers.intensityHistogram, size, {}) :
+				EnqueueBackProjection(timing, queue, kernels, buffers.imageInput, buffers.lookUpTable, buffers.imageOutput, size, {});
+			timing.Wait();
+			best = std::min(best, GetExecutionTime(timing.GetEvent(node)));
+		}
+		return best;
+	};
+
+	//sweep one stage, 'kernel' is the coarsened variant whose limits bound the local sizes
+	auto sweep = [&](const string& name, KernelConfig& stage, const cl::Kernel& kernel) {
+		const KernelLimits& limits = kernels.GetLimits(kernel, queue);
+		size_t max_size = limits.maxSize;
+		size_t multiple = limits.multiple;
+
+		KernelConfig best;
+		cl_ulong best_time = measure(stage, best);
+		log << name << ": max work group " << max_size << ", preferred multiple " << multiple << ", untuned " << best_time << " [ns]" << endl;
+
+		for (size_t local_size = multiple; local_size <= max_size; local_size *= 2) {
+			for (int coarsening : TUNING_COARSENING) {
+				KernelConfig candidate;
+				candidate.localSize = local_size;
+				candidate.coarsening = coarsening;
+
+				cl_ulong time = measure(stage, candidate);
+				log << "  local " << local_size << ", coarsening " << coarsening << ": " << time << " [ns]" << endl;
+
+				if (time < best_time) {
+					best_time = time;
+					best = candidate;
+				}
+			}
+		}
+
+		log << name << " best: local " << best.localSize << ", coarsening " << best.coarsening << ", " << best_time << " [ns]" << endl;
+		stage = best;
+	};
+
+	sweep("histogram", kernels.profile.histogram, kernels.histogramCoarse);
+	sweep("backProjection", kernels.profile.backProjection, kernels.backProjectionCoarse);
+
+	return kernels.profile;
+}
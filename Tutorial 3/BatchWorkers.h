@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "Equalizer.h"
+#include "StreamPipeline.h"
+
+//equalises a batch with a pool of host threads sharing one context and program
+//every worker owns its command queue, kernels (kernel arguments are not thread-safe) and buffers,
+//and claims the next image with an atomic counter, so workers never wait on each other
+//images of different workers run concurrently as far as the device executes independent queues concurrently
+class BatchWorkers {
+public:
+	BatchWorkers(const cl::Context& context, const cl::Program& program, int threads, bool out_of_order = false, const TuningProfile& profile = TuningProfile()) :
+		context(context),
+		program(program),
+		outOfOrder(out_of_order),
+		profile(profile),
+		threads(std::max(1, threads)) {}
+
+	//equalise every image of the batch, 'consume' is called from the worker threads in completion order
+	//and must be thread-safe; the statistics are summed over all workers
+	StreamStats Run(const ImageBatch& batch, const BatchConsumer& consume) {
+		vector<Worker> workers(threads);
+		vector<std::thread> pool;
+		std::atomic<size_t> next(0);
+
+		auto wall_start = std::chrono::high_resolution_clock::now();
+
+		for (Worker& worker : workers) {
+			pool.push_back(std::thread([&]() {
+				try {
+					worker.Run(context, program, outOfOrder, profile, batch, next, consume);
+				}
+				catch (...) {
+					worker.error = std::current_exception();
+					//let the other workers run out of images
+					next = batch.size();
+				}
+			}));
+		}
+
+		for (std::thread& thread : pool)
+			thread.join();
+
+		StreamStats stats;
+		cl_ulong first_start = ~(cl_ulong)0, last_end = 0;
+		for (Worker& worker : workers) {
+			if (worker.error)
+				std::rethrow_exception(worker.error);
+
+			stats.images += worker.stats.images;
+			stats.bytes += worker.stats.bytes;
+			stats.upload += worker.stats.upload;
+			stats.compute += worker.stats.compute;
+			stats.download += worker.stats.download;
+			first_start = std::min(first_start, worker.firstStart);
+			last_end = std::max(last_end, worker.lastEnd);
+		}
+
+		stats.wall = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - wall_start).count();
+		stats.span = (last_end > first_start) ? last_end - first_start : 0;
+
+		return stats;
+	}
+
+private:
+	struct Worker {
+		StreamStats stats;
+		cl_ulong firstStart = ~(cl_ulong)0;
+		cl_ulong lastEnd = 0;
+		std::exception_ptr error;
+
+		void Run(const cl::Context& context, const cl::Program& program, bool out_of_order, const TuningProfile& profile,
+			const ImageBatch& batch, std::atomic<size_t>& next, const BatchConsumer& consume) {
+			cl::CommandQueue queue(context, GetQueueProperties(context, out_of_order));
+			EqualizerKernels kernels(program, profile);
+			EqualizerBuffers buffers;
+
+			for (size_t i = next++; i < batch.size(); i = next++) {
+				CImg<unsigned char> input = batch.Load(i);
+				CImg<unsigned char> output(input.width(), input.height(), input.depth(), input.spectrum());
+				size_t image_size = input.size();
+				buffers.Reserve(context, image_size);
+
+				TaskGraph graph;
+				EqualizerEvents events;
+				TaskGraph::Node uploaded = graph.Add("upload", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+					queue.enqueueWriteBuffer(buffers.imageInput, CL_FALSE, 0, image_size, input.data(), wait, done);
+				});
+				TaskGraph::Node computed = EnqueueEqualize(graph, queue, kernels, buffers, image_size, { uploaded }, events);
+				TaskGraph::Node downloaded = graph.Add("download", { computed }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+					queue.enqueueReadBuffer(buffers.imageOutput, CL_FALSE, 0, image_size, output.data(), wait, done);
+				});
+				graph.Wait();
+
+				const cl::Event& upload = graph.GetEvent(uploaded);
+				const cl::Event& download = graph.GetEvent(downloaded);
+				stats.images++;
+				stats.bytes += image_size;
+				stats.upload += GetExecutionTime(upload);
+				stats.compute += GetExecutionTime(events.histogram) + GetExecutionTime(events.scan) +
+					GetExecutionTime(events.lut) + GetExecutionTime(events.backProjection);
+				stats.download += GetExecutionTime(download);
+				firstStart = std::min(firstStart, upload.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+				lastEnd = std::max(lastEnd, download.getProfilingInfo<CL_PROFILING_COMMAND_END>());
+
+				consume(i, output, events);
+			}
+		}
+	};
+
+	cl::Context context;
+	cl::Program program;
+	bool outOfOrder;
+	TuningProfile profile;
+	int threads;
+};
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "Equalizer.h"
+#include "OpenMPEqualizer.h"
+
+//what to measure: every image size is run with every local size, 'warmUp' untimed runs then 'repetitions' timed ones
+//a local size of 0 is the untuned launch, others run the coarse kernels with that local size and no coarsening
+//with 'openmp' every image size is also run by the OpenMP engine on the host, for a head-to-head comparison
+struct BenchmarkOptions {
+	int warmUp = 3;
+	int repetitions = 20;
+	vector<pair<int, int>> sizes; //width x height, empty for the size of the input image
+	vector<size_t> localSizes = { 0, 64, 128, 256 };
+	string format = "text"; //text, csv or json
+	bool openmp = false;
+};
+
+//order statistics of one metric, percentiles use the nearest rank
+struct BenchmarkSummary {
+	double min = 0.0;
+	double median = 0.0;
+	double p95 = 0.0;
+	double p99 = 0.0;
+	double mean = 0.0;
+};
+
+BenchmarkSummary Summarize(vector<double> samples) {
+	BenchmarkSummary summary;
+	if (samples.empty())
+		return summary;
+
+	std::sort(samples.begin(), samples.end());
+	auto rank = [&](double p) {
+		size_t index = (size_t)std::ceil(p * samples.size());
+		return samples[std::min(samples.size(), std::max((size_t)1, index)) - 1];
+	};
+
+	summary.min = samples.front();
+	summary.median = rank(0.5);
+	summary.p95 = rank(0.95);
+	summary.p99 = rank(0.99);
+	for (double sample : samples)
+		summary.mean += sample;
+	summary.mean /= samples.size();
+
+	return summary;
+}
+
+//one summarised metric of one configuration, times in microseconds
+struct BenchmarkRecord {
+	string engine = "opencl"; //or "openmp"
+	int width = 0;
+	int height = 0;
+	size_t localSize = 0;
+	string metric;
+	BenchmarkSummary summary;
+};
+
+//metrics recorded for every run: device time of each command, transfer and compute totals,
+//the device span from the start of the upload to the end of the download, and the host wall time around the whole run
+//(indexes of BENCHMARK_METRICS and of the samples of both engines)
+enum BenchmarkMetric {
+	METRIC_UPLOAD,
+	METRIC_HISTOGRAM,
+	METRIC_SCAN,
+	METRIC_LUT,
+	METRIC_BACK_PROJECTION,
+	METRIC_DOWNLOAD,
+	METRIC_TRANSFER,
+	METRIC_COMPUTE,
+	METRIC_DEVICE,
+	METRIC_WALL,
+	BENCHMARK_METRIC_COUNT
+};
+
+const char* BENCHMARK_METRICS[BENCHMARK_METRIC_COUNT] = { "upload", "histogram", "scan", "lut", "backProjection", "download", "transfer", "compute", "device", "wall" };
+
+//run the sweep on 'image' (resized to every requested size) and return one record per configuration and metric
+vector<BenchmarkRecord> RunBenchmark(const cl::Context& context, const cl::Program& program, const CImg<unsigned char>& image, const BenchmarkOptions& options) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+	EqualizerBuffers buffers;
+	vector<BenchmarkRecord> records;
+
+	vector<pair<int, int>> sizes = options.sizes;
+	if (sizes.empty())
+		sizes.push_back(make_pair(image.width(), image.height()));
+
+	for (const pair<int, int>& size : sizes) {
+		CImg<unsigned char> input = (size.first == image.width() && size.second == image.height()) ? image : image.get_resize(size.first, size.second, 1, -100, 1);
+		CImg<unsigned char> output(input.width(), input.height(), input.depth(), input.spectrum());
+		size_t image_size = input.size();
+		buffers.Reserve(context, image_size);
+
+		for (size_t local_size : options.localSizes) {
+			TuningProfile profile;
+			profile.histogram.localSize = local_size;
+			profile.backProjection.localSize = local_size;
+			EqualizerKernels kernels(program, profile);
+
+			//skip local sizes the device can not launch
+			if (local_size && (local_size > kernels.GetLimits(kernels.histogramCoarse, queue).maxSize ||
+				local_size > kernels.GetLimits(kernels.backProjectionCoarse, queue).maxSize))
+				continue;
+
+			vector<vector<double>> samples(BENCHMARK_METRIC_COUNT);
+
+			for (int r = 0; r < options.warmUp + options.repetitions; r++) {
+				auto wall_start = std::chrono::high_resolution_clock::now();
+
+				TaskGraph graph;
+				EqualizerEvents events;
+				TaskGraph::Node uploaded = graph.Add("upload", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+					queue.enqueueWriteBuffer(buffers.imageInput, CL_FALSE, 0, image_size, input.data(), wait, done);
+				});
+				TaskGraph::Node computed = EnqueueEqualize(graph, queue, kernels, buffers, image_size, { uploaded }, events);
+				TaskGraph::Node downloaded = graph.Add("download", { computed }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+					queue.enqueueReadBuffer(buffers.imageOutput, CL_FALSE, 0, image_size, output.data(), wait, done);
+				});
+				graph.Wait();
+
+				double wall = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - wall_start).count();
+				if (r < options.warmUp)
+					continue;
+
+				const cl::Event& upload = graph.GetEvent(uploaded);
+				const cl::Event& download = graph.GetEvent(downloaded);
+				double times[BENCHMARK_METRIC_COUNT] = {};
+				times[METRIC_UPLOAD] = (double)GetExecutionTime(upload);
+				times[METRIC_HISTOGRAM] = (double)GetExecutionTime(events.histogram);
+				times[METRIC_SCAN] = (double)GetExecutionTime(events.scan);
+				times[METRIC_LUT] = (double)GetExecutionTime(events.lut);
+				times[METRIC_BACK_PROJECTION] = (double)GetExecutionTime(events.backProjection);
+				times[METRIC_DOWNLOAD] = (double)GetExecutionTime(download);
+				times[METRIC_TRANSFER] = times[METRIC_UPLOAD] + times[METRIC_DOWNLOAD];
+				times[METRIC_COMPUTE] = times[METRIC_HISTOGRAM] + times[METRIC_SCAN] + times[METRIC_LUT] + times[METRIC_BACK_PROJECTION];
+				times[METRIC_DEVICE] = (double)(download.getProfilingInfo<CL_PROFILING_COMMAND_END>() - upload.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+
+				for (int m = 0; m < METRIC_WALL; m++)
+					samples[m].push_back(times[m] / PROF_US);
+				samples[METRIC_WALL].push_back(wall);
+			}
+
+			for (int m = 0; m < BENCHMARK_METRIC_COUNT; m++) {
+				BenchmarkRecord record;
+				record.width = input.width();
+				record.height = input.height();
+				record.localSize = local_size;
+				record.metric = BENCHMARK_METRICS[m];
+				record.summary = Summarize(samples[m]);
+				records.push_back(record);
+			}
+		}
+
+		//the host engine has no transfers, so only the stage times, their sum and the wall time are recorded
+		if (options.openmp) {
+			vector<cl_ulong> histogram, cumulative;
+			vector<mytype> lookUpTable;
+			vector<vector<double>> samples(BENCHMARK_METRIC_COUNT);
+
+			for (int r = 0; r < options.warmUp + options.repetitions; r++) {
+				auto wall_start = std::chrono::high_resolution_clock::now();
+				OpenMPTimes times = EqualizeOpenMP(input.data(), output.data(), image_size, histogram, cumulative, lookUpTable);
+				double wall = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - wall_start).count();
+				if (r < options.warmUp)
+					continue;
+
+				samples[METRIC_HISTOGRAM].push_back((double)times.histogram / PROF_US);
+				samples[METRIC_SCAN].push_back((double)times.scan / PROF_US);
+				samples[METRIC_LUT].push_back((double)times.lut / PROF_US);
+				samples[METRIC_BACK_PROJECTION].push_back((double)times.backProjection / PROF_US);
+				samples[METRIC_COMPUTE].push_back((double)times.GetTotal() / PROF_US);
+				samples[METRIC_WALL].push_back(wall);
+			}
+
+			for (int m = 0; m < BENCHMARK_METRIC_COUNT; m++) {
+				if (samples[m].empty())
+					continue;
+				BenchmarkRecord record;
+				record.engine = "openmp";
+				record.width = input.width();
+				record.height = input.height();
+				record.metric = BENCHMARK_METRICS[m];
+				record.summary = Summarize(samples[m]);
+				records.push_back(record);
+			}
+		}
+	}
+
+	return records;
+}
+
+//records as one line each, CSV with a header line, or a JSON document with the device and the run options
+string GetBenchmarkReport(const vector<BenchmarkRecord>& records, const BenchmarkOptions& options, const string& device) {
+	stringstream sstream;
+
+	if (options.format == "csv") {
+		sstream << "engine,width,height,local_size,metric,min_us,median_us,p95_us,p99_us,mean_us" << endl;
+		for (const BenchmarkRecord& record : records) {
+			sstream << record.engine << "," << record.width << "," << record.height << "," << record.localSize << "," << record.metric << ",";
+			sstream << record.summary.min << "," << record.summary.median << "," << record.summary.p95 << "," << record.summary.p99 << "," << record.summary.mean << endl;
+		}
+	}
+	else if (options.format == "json") {
+		sstream << "{\"device\": \"" << EscapeJson(device) << "\", \"openmp_threads\": " << GetOpenMPThreads();
+		sstream << ", \"warm_up\": " << options.warmUp << ", \"repetitions\": " << options.repetitions << ", \"results\": [" << endl;
+		for (size_t i = 0; i < records.size(); i++) {
+			const BenchmarkRecord& record = records[i];
+			sstream << "  {\"engine\": \"" << record.engine << "\", \"width\": " << record.width << ", \"height\": " << record.height << ", \"local_size\": " << record.localSize;
+			sstream << ", \"metric\": \"" << record.metric << "\", \"min_us\": " << record.summary.min << ", \"median_us\": " << record.summary.median;
+			sstream << ", \"p95_us\": " << record.summary.p95 << ", \"p99_us\": " << record.summary.p99 << ", \"mean_us\": " << record.summary.mean << "}";
+			sstream << (i + 1 < records.size() ? "," : "") << endl;
+		}
+		sstream << "]}" << endl;
+	}
+	else {
+		sstream << device << ", " << options.warmUp << " warm-up, " << options.repetitions << " timed runs [us]" << endl;
+		if (options.openmp)
+			sstream << "OpenMP engine: " << GetOpenMPThreads() << " thread(s)" << endl;
+		for (const BenchmarkRecord& record : records) {
+			sstream << record.width << "x" << record.height;
+			if (record.engine == "openmp")
+				sstream << " openmp " << record.metric;
+			else
+				sstream << " local " << record.localSize << " " << record.metric;
+			sstream << ": min " << record.summary.min << ", median " << record.summary.median << ", p95 " << record.summary.p95 << ", p99 " << record.summary.p99 << endl;
+		}
+	}
+
+	return sstream.str();
+}
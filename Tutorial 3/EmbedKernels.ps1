@@ -0,0 +1,27 @@
+# Pre-build step: turns the kernel file into a header defining EMBEDDED_KERNEL_SOURCE,
+# so the executable does not need kernels/my_kernels.cl at runtime (see KernelSource.h).
+# The header is only rewritten when the kernels change, so unchanged kernels do not trigger a rebuild.
+param(
+	[string]$Source = "kernels\my_kernels.cl",
+	[string]$Header = "kernels\my_kernels.cl.h"
+)
+
+$text = [IO.File]::ReadAllText($Source)
+
+# MSVC limits a single string literal to about 16 KB, adjacent literals are concatenated by the compiler
+$chunk = 4000
+$lines = @(
+	"//generated from $(Split-Path $Source -Leaf) by EmbedKernels.ps1 before every build, do not edit",
+	"#pragma once",
+	"",
+	"const char EMBEDDED_KERNEL_SOURCE[] ="
+)
+for ($i = 0; $i -lt $text.Length; $i += $chunk) {
+	$lines += 'R"CLSRC(' + $text.Substring($i, [Math]::Min($chunk, $text.Length - $i)) + ')CLSRC"'
+}
+$lines += '"";'
+$output = ($lines -join "`n") + "`n"
+
+if (!(Test-Path $Header) -or ([IO.File]::ReadAllText($Header) -ne $output)) {
+	[IO.File]::WriteAllText($Header, $output)
+}
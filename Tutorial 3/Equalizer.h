@@ -0,0 +1,419 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "Utils.h"
+#include "CImg.h"
+#include "TaskGraph.h"
+#include "BufferPool.h"
+
+using namespace cimg_library;
+
+typedef int mytype;
+
+//number of intensity levels in an 8-bit image
+const int BIN_COUNT = 256;
+
+//launch configuration of a tunable kernel, a local size of 0 selects the plain kernel with the default local size
+struct KernelConfig {
+	size_t localSize = 0;
+	int coarsening = 1;
+
+	bool IsTuned() const { return localSize != 0; }
+};
+
+//tuned configurations of one device, see Autotuner.h
+struct TuningProfile {
+	KernelConfig histogram;
+	KernelConfig backProjection;
+};
+
+//parameters fixed at compile time in a specialized build of the kernels, see Specialization.h
+//a vector width of 0 selects the generic kernels, which take these values (if any) as arguments
+struct KernelSpecialization {
+	int bins = BIN_COUNT;
+	string counterType = "uint"; //int or uint, both share the 4-byte layout of mytype
+	int vectorWidth = 0; //pixels per work item: 1, 2, 4, 8 or 16
+	int replication = 1; //copies of the local histogram per work group
+	string lutType = "int"; //int or uchar
+
+	bool IsEnabled() const { return vectorWidth != 0; }
+
+	string GetBuildOptions() const {
+		if (!IsEnabled())
+			return "";
+
+		stringstream options;
+		options << "-DSPECIALIZED -DNR_BINS=" << bins << " -DCOUNTER_T=" << counterType << " -DVECTOR_WIDTH=" << vectorWidth;
+		options << " -DREPLICATION=" << replication << " -DLUT_T=" << lutType;
+		return options.str();
+	}
+};
+
+//launch limits of a kernel on one device: CL_KERNEL_WORK_GROUP_SIZE (capped by the device maximum of the registry)
+//and the preferred work group size multiple
+struct KernelLimits {
+	cl::CommandQueue queue; //the limits were queried for, held so that its handle is not reused while cached
+	size_t maxSize = 0;
+	size_t multiple = 1;
+};
+
+KernelLimits GetKernelLimits(const cl::Kernel& kernel, const cl::CommandQueue& queue) {
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	KernelLimits limits;
+	limits.queue = queue;
+	limits.maxSize = std::min(kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), GetDeviceInfo(device).maxWorkGroupSize);
+	limits.multiple = std::max((size_t)1, kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device));
+	return limits;
+}
+
+//explicit local size of an untuned launch: BIN_COUNT work items, so a work group clears and merges its bins in one step,
+//limited by what the kernel allows on the device and rounded down to the preferred multiple
+//every kernel is guarded, so the global size is then simply padded up to a multiple of it
+size_t GetLocalSize(const KernelLimits& limits) {
+	size_t local_size = std::min((size_t)BIN_COUNT, limits.maxSize);
+	if (local_size >= limits.multiple)
+		local_size -= local_size % limits.multiple;
+
+	return local_size;
+}
+
+//same as above for a one-off launch of 'kernel' on the device of 'queue'
+size_t GetLocalSize(const cl::Kernel& kernel, const cl::CommandQueue& queue) {
+	return GetLocalSize(GetKernelLimits(kernel, queue));
+}
+
+//the four kernels of the equalisation pipeline, created once per program and reused for every image
+//tuned stages use the coarsened kernel variants with the tuned local size, the others a default local size (see GetLocalSize)
+//a program built with a specialization replaces the histogram, LUT and back projection with their specialized kernels
+struct EqualizerKernels {
+	cl::Kernel histogram;
+	cl::Kernel histogramCoarse;
+	cl::Kernel scan;
+	cl::Kernel scanSerial;
+	cl::Kernel lut;
+	cl::Kernel backProjection;
+	cl::Kernel backProjectionCoarse;
+	cl::Kernel histogramSpecialized;
+	cl::Kernel lutSpecialized;
+	cl::Kernel backProjectionSpecialized;
+	TuningProfile profile;
+	KernelSpecialization specialization;
+
+	EqualizerKernels() {}
+
+	EqualizerKernels(const cl::Program& program, const TuningProfile& profile = TuningProfile(),
+		const KernelSpecialization& specialization = KernelSpecialization()) :
+		histogram(program, "histLocalSimple"),
+		histogramCoarse(program, "histLocalCoarse"),
+		scan(program, "scan_add"),
+		scanSerial(program, "scanSerial"),
+		lut(program, "LUT"),
+		backProjection(program, "backProjection"),
+		backProjectionCoarse(program, "backProjectionCoarse"),
+		profile(profile),
+		specialization(specialization) {
+		if (specialization.IsEnabled()) {
+			histogramSpecialized = cl::Kernel(program, "histSpecialized");
+			lutSpecialized = cl::Kernel(program, "lutSpecialized");
+			backProjectionSpecialized = cl::Kernel(program, "backProjectionSpecialized");
+		}
+	}
+
+	//limits of one of the kernels above on the device of 'queue', queried on its first launch there only
+	//(the kernels of a MultiDeviceEqualizer are launched on several devices)
+	const KernelLimits& GetLimits(const cl::Kernel& kernel, const cl::CommandQueue& queue) {
+		pair<cl_command_queue, cl_kernel> key(queue(), kernel());
+		map<pair<cl_command_queue, cl_kernel>, KernelLimits>::iterator found = limits.find(key);
+		if (found != limits.end())
+			return found->second;
+
+		return limits[key] = GetKernelLimits(kernel, queue);
+	}
+
+	//default local size of one of the kernels above on the device of 'queue'
+	size_t GetLocalSize(const cl::Kernel& kernel, const cl::CommandQueue& queue) {
+		return ::GetLocalSize(GetLimits(kernel, queue));
+	}
+
+	//true if 'config' is tuned and its local size is allowed for 'kernel' on the device of 'queue'
+	//a profile tuned before a driver or kernel change may no longer be, the untuned launch is used then
+	bool IsTunedFor(const cl::Kernel& kernel, const cl::CommandQueue& queue, const KernelConfig& config) {
+		return config.IsTuned() && config.localSize <= GetLimits(kernel, queue).maxSize;
+	}
+
+	//local size of a specialized kernel: the one tuned for the coarse variant when 'kernel' allows it,
+	//otherwise (not tuned, or the specialized variant needs more resources per work item) the default one
+	size_t GetLocalSize(const cl::Kernel& kernel, const cl::CommandQueue& queue, const KernelConfig& config) {
+		if (IsTunedFor(kernel, queue, config))
+			return config.localSize;
+
+		return GetLocalSize(kernel, queue);
+	}
+
+	map<pair<cl_command_queue, cl_kernel>, KernelLimits> limits;
+};
+
+//device memory needed by one image in flight
+//buffers are only reallocated when an image larger than the current capacity arrives
+struct EqualizerBuffers {
+	size_t capacity = 0;
+	cl::Buffer imageInput;
+	cl::Buffer imageOutput;
+	cl::Buffer intensityHistogram;
+	cl::Buffer cumulativeHistogram;
+	cl::Buffer lookUpTable;
+
+	void Reserve(const cl::Context& context, size_t image_size) {
+		size_t hist_size = BIN_COUNT * sizeof(mytype);
+
+		if (!intensityHistogram()) {
+			intensityHistogram = cl::Buffer(context, CL_MEM_READ_WRITE, hist_size);
+			cumulativeHistogram = cl::Buffer(context, CL_MEM_READ_WRITE, hist_size);
+			lookUpTable = cl::Buffer(context, CL_MEM_READ_WRITE, hist_size);
+		}
+
+		if (image_size > capacity) {
+			imageInput = cl::Buffer(context, CL_MEM_READ_ONLY, image_size);
+			imageOutput = cl::Buffer(context, CL_MEM_READ_WRITE, image_size);
+			capacity = image_size;
+		}
+	}
+
+	//same as above with buffers recycled through 'pool', buffers outgrown by a larger image go back to it
+	//the capacity is that of the size class, so images of similar sizes keep the same buffers
+	void Reserve(BufferPool& pool, size_t image_size) {
+		size_t hist_size = BIN_COUNT * sizeof(mytype);
+
+		if (!intensityHistogram()) {
+			intensityHistogram = pool.Acquire(CL_MEM_READ_WRITE, hist_size);
+			cumulativeHistogram = pool.Acquire(CL_MEM_READ_WRITE, hist_size);
+			lookUpTable = pool.Acquire(CL_MEM_READ_WRITE, hist_size);
+		}
+
+		if (image_size > capacity) {
+			pool.Release(imageInput);
+			pool.Release(imageOutput);
+			imageInput = pool.Acquire(CL_MEM_READ_ONLY, image_size);
+			imageOutput = pool.Acquire(CL_MEM_READ_WRITE, image_size);
+			capacity = BufferPool::GetSizeClass(image_size);
+		}
+	}
+
+	//hand every buffer back to 'pool'
+	void Release(BufferPool& pool) {
+		for (cl::Buffer* buffer : { &imageInput, &imageOutput, &intensityHistogram, &cumulativeHistogram, &lookUpTable }) {
+			pool.Release(*buffer);
+			*buffer = cl::Buffer();
+		}
+		capacity = 0;
+	}
+
+	//zero-copy variant for devices sharing memory with the host: the image buffers are created over host memory
+	//owned by the caller (ideally page aligned), so no upload is needed and the output is accessed by mapping it
+	void Wrap(const cl::Context& context, size_t image_size, unsigned char* host_input, unsigned char* host_output) {
+		Reserve(context, 0);
+
+		imageInput = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, image_size, host_input);
+		imageOutput = cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, image_size, host_output);
+		//the wrapped buffers can not be reused for larger images
+		capacity = 0;
+	}
+};
+
+//profiling events of the kernels enqueued for one image
+struct EqualizerEvents {
+	cl::Event histogram;
+	cl::Event scan;
+	cl::Event lut;
+	cl::Event backProjection;
+};
+
+//accumulate the intensity histogram of 'size' pixels of 'input' into 'histogram'
+//the histogram is not cleared, so consecutive tiles of one image can add to the same bins
+TaskGraph::Node EnqueueHistogram(TaskGraph& graph, cl::CommandQueue& queue, EqualizerKernels& kernels,
+	const cl::Buffer& input, const cl::Buffer& histogram, size_t size, const vector<TaskGraph::Node>& dependencies) {
+	return graph.Add("histogram", dependencies, [&](const vector<cl::Event>* wait, cl::Event* done) {
+		const KernelConfig& config = kernels.profile.histogram;
+
+		if (kernels.specialization.IsEnabled()) {
+			//one work item per vector of pixels, the tuned local size still applies where the kernel allows it
+			size_t local_size = kernels.GetLocalSize(kernels.histogramSpecialized, queue, config);
+			size_t vectors = (size + kernels.specialization.vectorWidth - 1) / kernels.specialization.vectorWidth;
+			kernels.histogramSpecialized.setArg(0, input);
+			kernels.histogramSpecialized.setArg(1, histogram);
+			kernels.histogramSpecialized.setArg(2, (cl_ulong)size);
+			queue.enqueueNDRangeKernel(kernels.histogramSpecialized, cl::NullRange, cl::NDRange(RoundUp(vectors, local_size)), cl::NDRange(local_size), wait, done);
+			return;
+		}
+
+		if (kernels.IsTunedFor(kernels.histogramCoarse, queue, config)) {
+			//one work item per 'coarsening' pixels, padded to whole work groups
+			size_t global_size = RoundUp((size + config.coarsening - 1) / config.coarsening, config.localSize);
+			kernels.histogramCoarse.setArg(0, input);
+			kernels.histogramCoarse.setArg(1, histogram);
+			kernels.histogramCoarse.setArg(2, cl::Local(BIN_COUNT * sizeof(mytype)));
+			kernels.histogramCoarse.setArg(3, BIN_COUNT);
+			kernels.histogramCoarse.setArg(4, config.coarsening);
+			kernels.histogramCoarse.setArg(5, (cl_ulong)size);
+			queue.enqueueNDRangeKernel(kernels.histogramCoarse, cl::NullRange, cl::NDRange(global_size), cl::NDRange(config.localSize), wait, done);
+			return;
+		}
+
+		size_t local_size = kernels.GetLocalSize(kernels.histogram, queue);
+		kernels.histogram.setArg(0, input);
+		kernels.histogram.setArg(1, histogram);
+		kernels.histogram.setArg(2, cl::Local(BIN_COUNT * sizeof(mytype)));
+		kernels.histogram.setArg(3, BIN_COUNT);
+		kernels.histogram.setArg(4, (cl_ulong)size);
+		queue.enqueueNDRangeKernel(kernels.histogram, cl::NullRange, cl::NDRange(RoundUp(size, local_size)), cl::NDRange(local_size), wait, done);
+	});
+}
+
+//cumulative histogram of the complete image
+//the scan runs as a single work group of one work item per bin so that all bins are summed together,
+//or as a single work item on devices (or builds of scan_add) that do not allow BIN_COUNT work items per group
+TaskGraph::Node EnqueueScan(TaskGraph& graph, cl::CommandQueue& queue, EqualizerKernels& kernels,
+	EqualizerBuffers& buffers, const vector<TaskGraph::Node>& dependencies) {
+	return graph.Add("scan", dependencies, [&](const vector<cl::Event>* wait, cl::Event* done) {
+		if (kernels.GetLimits(kernels.scan, queue).maxSize < (size_t)BIN_COUNT) {
+			kernels.scanSerial.setArg(0, buffers.intensityHistogram);
+			kernels.scanSerial.setArg(1, buffers.cumulativeHistogram);
+			kernels.scanSerial.setArg(2, BIN_COUNT);
+			queue.enqueueNDRangeKernel(kernels.scanSerial, cl::NullRange, cl::NDRange(1), cl::NDRange(1), wait, done);
+			return;
+		}
+
+		kernels.scan.setArg(0, buffers.intensityHistogram);
+		kernels.scan.setArg(1, buffers.cumulativeHistogram);
+		kernels.scan.setArg(2, cl::Local(BIN_COUNT * sizeof(mytype)));
+		kernels.scan.setArg(3, cl::Local(BIN_COUNT * sizeof(mytype)));
+		queue.enqueueNDRangeKernel(kernels.scan, cl::NullRange, cl::NDRange(BIN_COUNT), cl::NDRange(BIN_COUNT), wait, done);
+	});
+}
+
+//rescale the cumulative histogram into the look-up table used by the back projection
+TaskGraph::Node EnqueueLookUpTable(TaskGraph& graph, cl::CommandQueue& queue, EqualizerKernels& kernels,
+	EqualizerBuffers& buffers, const vector<TaskGraph::Node>& dependencies) {
+	return graph.Add("LUT", dependencies, [&](const vector<cl::Event>* wait, cl::Event* done) {
+		if (kernels.specialization.IsEnabled()) {
+			size_t local_size = kernels.GetLocalSize(kernels.lutSpecialized, queue);
+			kernels.lutSpecialized.setArg(0, buffers.cumulativeHistogram);
+			kernels.lutSpecialized.setArg(1, buffers.lookUpTable);
+			queue.enqueueNDRangeKernel(kernels.lutSpecialized, cl::NullRange, cl::NDRange(RoundUp(BIN_COUNT, local_size)), cl::NDRange(local_size), wait, done);
+			return;
+		}
+
+		size_t local_size = kernels.GetLocalSize(kernels.lut, queue);
+		kernels.lut.setArg(0, buffers.cumulativeHistogram);
+		kernels.lut.setArg(1, buffers.lookUpTable);
+		kernels.lut.setArg(2, BIN_COUNT);
+		queue.enqueueNDRangeKernel(kernels.lut, cl::NullRange, cl::NDRange(RoundUp(BIN_COUNT, local_size)), cl::NDRange(local_size), wait, done);
+	});
+}
+
+//map 'size' pixels of 'input' through the look-up table into 'output'
+TaskGraph::Node EnqueueBackProjection(TaskGraph& graph, cl::CommandQueue& queue, EqualizerKernels& kernels,
+	const cl::Buffer& input, const cl::Buffer& lookUpTable, const cl::Buffer& output, size_t size, const vector<TaskGraph::Node>& dependencies) {
+	return graph.Add("back projection", dependencies, [&](const vector<cl::Event>* wait, cl::Event* done) {
+		const KernelConfig& config = kernels.profile.backProjection;
+
+		if (kernels.specialization.IsEnabled()) {
+			size_t local_size = kernels.GetLocalSize(kernels.backProjectionSpecialized, queue, config);
+			size_t vectors = (size + kernels.specialization.vectorWidth - 1) / kernels.specialization.vectorWidth;
+			kernels.backProjectionSpecialized.setArg(0, input);
+			kernels.backProjectionSpecialized.setArg(1, lookUpTable);
+			kernels.backProjectionSpecialized.setArg(2, output);
+			kernels.backProjectionSpecialized.setArg(3, (cl_ulong)size);
+			queue.enqueueNDRangeKernel(kernels.backProjectionSpecialized, cl::NullRange, cl::NDRange(RoundUp(vectors, local_size)), cl::NDRange(local_size), wait, done);
+			return;
+		}
+
+		if (kernels.IsTunedFor(kernels.backProjectionCoarse, queue, config)) {
+			size_t global_size = RoundUp((size + config.coarsening - 1) / config.coarsening, config.localSize);
+			kernels.backProjectionCoarse.setArg(0, input);
+			kernels.backProjectionCoarse.setArg(1, lookUpTable);
+			kernels.backProjectionCoarse.setArg(2, output);
+			kernels.backProjectionCoarse.setArg(3, config.coarsening);
+			kernels.backProjectionCoarse.setArg(4, (cl_ulong)size);
+			queue.enqueueNDRangeKernel(kernels.backProjectionCoarse, cl::NullRange, cl::NDRange(global_size), cl::NDRange(config.localSize), wait, done);
+			return;
+		}
+
+		size_t local_size = kernels.GetLocalSize(kernels.backProjection, queue);
+		kernels.backProjection.setArg(0, input);
+		kernels.backProjection.setArg(1, lookUpTable);
+		kernels.backProjection.setArg(2, output);
+		kernels.backProjection.setArg(3, (cl_ulong)size);
+		queue.enqueueNDRangeKernel(kernels.backProjection, cl::NullRange, cl::NDRange(RoundUp(size, local_size)), cl::NDRange(local_size), wait, done);
+	});
+}
+
+//add histogram -> cumulative histogram -> LUT -> back projection for an image already uploaded to buffers.imageInput
+//the histogram is cleared first, so the same buffers can be reused for the next image
+//every command waits only on its predecessor, the first one on 'dependencies'; returns the back projection node
+TaskGraph::Node EnqueueEqualize(TaskGraph& graph, cl::CommandQueue& queue, EqualizerKernels& kernels, EqualizerBuffers& buffers,
+	size_t image_size, const vector<TaskGraph::Node>& dependencies, EqualizerEvents& events) {
+	TaskGraph::Node cleared = graph.Add("clear histogram", dependencies, [&](const vector<cl::Event>* wait, cl::Event* done) {
+		queue.enqueueFillBuffer(buffers.intensityHistogram, 0, 0, BIN_COUNT * sizeof(mytype), wait, done);
+	});
+
+	TaskGraph::Node histogram = EnqueueHistogram(graph, queue, kernels, buffers.imageInput, buffers.intensityHistogram, image_size, { cleared });
+	TaskGraph::Node scan = EnqueueScan(graph, queue, kernels, buffers, { histogram });
+	TaskGraph::Node lut = EnqueueLookUpTable(graph, queue, kernels, buffers, { scan });
+	TaskGraph::Node projected = EnqueueBackProjection(graph, queue, kernels, buffers.imageInput, buffers.lookUpTable, buffers.imageOutput, image_size, { lut });
+
+	events.histogram = graph.GetEvent(histogram);
+	events.scan = graph.GetEvent(scan);
+	events.lut = graph.GetEvent(lut);
+	events.backProjection = graph.GetEvent(projected);
+
+	return projected;
+}
+
+//host equivalent of the scan kernel: inclusive prefix sum of the bins
+void ScanHistogram(const vector<mytype>& histogram, vector<mytype>& cumulative) {
+	cumulative.resize(BIN_COUNT);
+
+	mytype sum = 0;
+	for (int i = 0; i < BIN_COUNT; i++) {
+		sum += histogram[i];
+		cumulative[i] = sum;
+	}
+}
+
+//host equivalent of the LUT kernel
+void ScaleLookUpTable(const vector<mytype>& cumulative, vector<mytype>& lookUpTable) {
+	lookUpTable.resize(BIN_COUNT);
+
+	mytype sum = cumulative[BIN_COUNT - 1];
+	for (int i = 0; i < BIN_COUNT; i++)
+		lookUpTable[i] = sum ? (mytype)(cumulative[i] * (double)255 / sum) : 0;
+}
+
+//64-bit counterparts of the above, for histograms of more pixels than mytype can count
+void ScanHistogram(const vector<cl_ulong>& histogram, vector<cl_ulong>& cumulative) {
+	cumulative.resize(BIN_COUNT);
+
+	cl_ulong sum = 0;
+	for (int i = 0; i < BIN_COUNT; i++) {
+		sum += histogram[i];
+		cumulative[i] = sum;
+	}
+}
+
+void ScaleLookUpTable(const vector<cl_ulong>& cumulative, vector<mytype>& lookUpTable) {
+	lookUpTable.resize(BIN_COUNT);
+
+	cl_ulong sum = cumulative[BIN_COUNT - 1];
+	for (int i = 0; i < BIN_COUNT; i++)
+		lookUpTable[i] = sum ? (mytype)(cumulative[i] * (double)255 / sum) : 0;
+}
+
+//host equivalent of the scan and LUT kernels, used where the histogram is only complete on the host
+void BuildLookUpTable(const vector<mytype>& histogram, vector<mytype>& cumulative, vector<mytype>& lookUpTable) {
+	ScanHistogram(histogram, cumulative);
+	ScaleLookUpTable(cumulative, lookUpTable);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+
+#include "Utils.h"
+
+//kernels/my_kernels.cl.h is generated from the kernel file by the pre-build step of the project (EmbedKernels.ps1)
+//and defines EMBEDDED_KERNEL_SOURCE; without it, e.g. in builds outside Visual Studio, the kernels are read at runtime
+#if defined(__has_include)
+#if __has_include("kernels/my_kernels.cl.h")
+#include "kernels/my_kernels.cl.h"
+#define HAS_EMBEDDED_KERNELS
+#endif
+#endif
+
+//the kernel file, read when nothing is embedded; binaries built from either source are cached next to it
+const string KERNEL_FILE = "kernels/my_kernels.cl";
+
+//source of the kernels: 'file_name' if one is given (to try kernel changes without rebuilding),
+//otherwise the copy embedded at build time, otherwise KERNEL_FILE
+string GetKernelSource(const string& file_name) {
+	if (!file_name.empty())
+		return LoadSource(file_name);
+
+#ifdef HAS_EMBEDDED_KERNELS
+	return EMBEDDED_KERNEL_SOURCE;
+#else
+	return LoadSource(KERNEL_FILE);
+#endif
+}
+
+bool HasEmbeddedKernels() {
+#ifdef HAS_EMBEDDED_KERNELS
+	return true;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+#include "Equalizer.h"
+
+//amount of the image used to measure the throughput of each device
+const size_t CALIBRATION_SIZE = 1 << 20;
+
+//slice of the image given to one device and the device time spent on it
+struct DeviceSlice {
+	string device;
+	size_t offset = 0;
+	size_t size = 0;
+	double throughput = 0.0; //calibrated histogram throughput [B/ns]
+	cl_ulong histogram = 0;
+	cl_ulong backProjection = 0;
+};
+
+//largest image MultiDeviceEqualizer can split across the devices of 'context': every slice must fit a single allocation
+//of its device and the merged histogram is counted in 32 bits, larger images go through TiledEqualizer instead
+size_t GetMultiDeviceCapacity(const cl::Context& context) {
+	size_t capacity = 0;
+	for (const cl::Device& device : context.getInfo<CL_CONTEXT_DEVICES>())
+		capacity += (size_t)GetDeviceInfo(device).maxAllocSize;
+
+	return std::min(capacity, (size_t)INT_MAX);
+}
+
+//splits one image across every device of a context
+//each device computes a partial histogram of its slice, the partial histograms are merged on the host,
+//and the LUT built from the merged histogram is broadcast so that each device back-projects its own slice
+class MultiDeviceEqualizer {
+public:
+	MultiDeviceEqualizer(const cl::Context& context, const cl::Program& program) :
+		context(context),
+		kernels(program) {
+		for (const cl::Device& device : context.getInfo<CL_CONTEXT_DEVICES>()) {
+			Device entry;
+			entry.device = device;
+			entry.queue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+			devices.push_back(entry);
+		}
+	}
+
+	size_t size() const { return devices.size(); }
+
+
+	//measure the histogram throughput of every device on a sample of the image,
+	//slices are then sized in proportion so that all devices finish at about the same time
+	void Calibrate(const unsigned char* sample, size_t size) {
+		for (Device& entry : devices) {
+			entry.buffers.Reserve(context, size);
+
+			TaskGraph graph;
+			TaskGraph::Node uploaded = graph.Add("upload", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				entry.queue.enqueueWriteBuffer(entry.buffers.imageInput, CL_FALSE, 0, size, sample, wait, done);
+			});
+			//the first launch includes one-off costs, only the second one is timed
+			TaskGraph::Node warm_up = EnqueueHistogram(graph, entry.queue, kernels, entry.buffers.imageInput, entry.buffers.intensityHistogram, size, { uploaded });
+			TaskGraph::Node timed = EnqueueHistogram(graph, entry.queue, kernels, entry.buffers.imageInput, entry.buffers.intensityHistogram, size, { warm_up });
+			graph.Wait();
+
+			entry.throughput = (double)size / std::max((cl_ulong)1, GetExecutionTime(graph.GetEvent(timed)));
+		}
+	}
+
+	//equalise 'input' into 'output' (both image_size bytes, at most GetMultiDeviceCapacity), returns the slice of each device
+	vector<DeviceSlice> Run(const unsigned char* input, unsigned char* output, size_t image_size) {
+		if (image_size > GetMultiDeviceCapacity(context))
+			throw cl::Error(CL_INVALID_BUFFER_SIZE, "MultiDeviceEqualizer::Run");
+		Partition(image_size);
+
+		//partial histograms of every slice, all devices at once
+		vector<vector<mytype>> partial(devices.size(), vector<mytype>(BIN_COUNT));
+		vector<TaskGraph> graphs(devices.size());
+		vector<TaskGraph::Node> histograms(devices.size());
+
+		for (size_t i = 0; i < devices.size(); i++) {
+			Device& entry = devices[i];
+			TaskGraph& graph = graphs[i];
+			if (!entry.size)
+				continue;
+
+			entry.buffers.Reserve(context, entry.size);
+
+			TaskGraph::Node uploaded = graph.Add("upload", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				entry.queue.enqueueWriteBuffer(entry.buffers.imageInput, CL_FALSE, 0, entry.size, input + entry.offset, wait, done);
+			});
+			TaskGraph::Node cleared = graph.Add("clear histogram", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				entry.queue.enqueueFillBuffer(entry.buffers.intensityHistogram, 0, 0, BIN_COUNT * sizeof(mytype), wait, done);
+			});
+			histograms[i] = EnqueueHistogram(graph, entry.queue, kernels, entry.buffers.imageInput, entry.buffers.intensityHistogram, entry.size, { uploaded, cleared });
+			graph.Add("read histogram", { histograms[i] }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				entry.queue.enqueueReadBuffer(entry.buffers.intensityHistogram, CL_FALSE, 0, BIN_COUNT * sizeof(mytype), &partial[i][0], wait, done);
+			});
+			entry.queue.flush();
+		}
+
+		//merge on the host
+		vector<mytype> histogram(BIN_COUNT, 0);
+		for (size_t i = 0; i < devices.size(); i++) {
+			graphs[i].Wait();
+			for (int bin = 0; bin < BIN_COUNT; bin++)
+				histogram[bin] += partial[i][bin];
+		}
+
+		vector<mytype> cumulative, lookUpTable;
+		BuildLookUpTable(histogram, cumulative, lookUpTable);
+
+		//broadcast the LUT, each device maps its own slice
+		vector<TaskGraph::Node> projections(devices.size());
+		for (size_t i = 0; i < devices.size(); i++) {
+			Device& entry = devices[i];
+			TaskGraph& graph = graphs[i];
+			if (!entry.size)
+				continue;
+
+			TaskGraph::Node broadcast = graph.Add("write LUT", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				entry.queue.enqueueWriteBuffer(entry.buffers.lookUpTable, CL_FALSE, 0, BIN_COUNT * sizeof(mytype), &lookUpTable[0], wait, done);
+			});
+			projections[i] = EnqueueBackProjection(graph, entry.queue, kernels, entry.buffers.imageInput, entry.buffers.lookUpTable, entry.buffers.imageOutput, entry.size, { broadcast });
+			graph.Add("download", { projections[i] }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				entry.queue.enqueueReadBuffer(entry.buffers.imageOutput, CL_FALSE, 0, entry.size, output + entry.offset, wait, done);
+			});
+			entry.queue.flush();
+		}
+
+		vector<DeviceSlice> slices;
+		for (size_t i = 0; i < devices.size(); i++) {
+			Device& entry = devices[i];
+			DeviceSlice slice;
+			slice.device = GetDeviceInfo(entry.device).name;
+			slice.offset = entry.offset;
+			slice.size = entry.size;
+			slice.throughput = entry.throughput;
+			if (entry.size) {
+				graphs[i].Wait();
+				slice.histogram = GetExecutionTime(graphs[i].GetEvent(histograms[i]));
+				slice.backProjection = GetExecutionTime(graphs[i].GetEvent(projections[i]));
+			}
+			slices.push_back(slice);
+		}
+
+		return slices;
+	}
+
+private:
+	struct Device {
+		cl::Device device;
+		cl::CommandQueue queue;
+		EqualizerBuffers buffers;
+		double throughput = 1.0;
+		size_t offset = 0;
+		size_t size = 0;
+	};
+
+	//split the image in proportion to the calibrated throughputs, the last device takes the remainder
+	//no slice exceeds the allocation limit of its device, what a device can not take goes to the next ones with room
+	void Partition(size_t image_size) {
+		double total = 0.0;
+		for (const Device& entry : devices)
+			total += entry.throughput;
+
+		size_t assigned = 0;
+		for (size_t i = 0; i < devices.size(); i++) {
+			size_t size = (i + 1 == devices.size()) ? image_size - assigned : (size_t)(image_size * (devices[i].throughput / total));
+			size = std::min(std::min(size, image_size - assigned), (size_t)GetDeviceInfo(devices[i].device).maxAllocSize);
+			devices[i].size = size;
+			assigned += size;
+		}
+
+		for (size_t i = 0; i < devices.size() && assigned < image_size; i++) {
+			size_t extra = std::min(image_size - assigned, (size_t)GetDeviceInfo(devices[i].device).maxAllocSize - devices[i].size);
+			devices[i].size += extra;
+			assigned += extra;
+		}
+
+		size_t offset = 0;
+		for (Device& entry : devices) {
+			entry.offset = offset;
+			offset += entry.size;
+		}
+	}
+
+	cl::Context context;
+	EqualizerKernels kernels;
+	vector<Device> devices;
+};
+
+string GetMultiDeviceReport(const vector<DeviceSlice>& slices) {
+	stringstream sstream;
+
+	for (const DeviceSlice& slice : slices) {
+		sstream << slice.device << ": " << slice.size << " [B] at " << slice.offset;
+		sstream << ", calibrated " << slice.throughput << " [B/ns]";
+		sstream << ", Histogram " << slice.histogram / PROF_US << ", Back projection " << slice.backProjection / PROF_US << " [us]" << endl;
+	}
+
+	return sstream.str();
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "Equalizer.h"
+
+//threads of the OpenMP engine, OMP_NUM_THREADS by default; 1 when built without OpenMP
+int GetOpenMPThreads() {
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+//host time of each stage of one run [ns], the counterpart of EqualizerEvents for the OpenMP engine
+struct OpenMPTimes {
+	cl_ulong histogram = 0;
+	cl_ulong scan = 0;
+	cl_ulong lut = 0;
+	cl_ulong backProjection = 0;
+
+	cl_ulong GetTotal() const { return histogram + scan + lut + backProjection; }
+};
+
+//the pipeline on host cores, for many-core CPUs where it may beat the OpenCL CPU runtime:
+//every thread counts its contiguous share of the pixels into a private histogram, the private histograms are merged
+//by a tree reduction (log2(threads) levels of pairwise additions), the scan and LUT over the 256 bins run serially,
+//and the back projection is split across the threads again with a vectorisable lookup loop
+//pixels are split by hand rather than with "omp for", as MSVC (OpenMP 2.0) only accepts int loop counters
+//bins are counted in 64 bits, so unlike the device path no image is too large for a single pass
+OpenMPTimes EqualizeOpenMP(const unsigned char* input, unsigned char* output, size_t size,
+	vector<cl_ulong>& histogram, vector<cl_ulong>& cumulative, vector<mytype>& lookUpTable, int threads = 0) {
+	OpenMPTimes times;
+	if (threads <= 0)
+		threads = GetOpenMPThreads();
+
+	auto elapsed = [](std::chrono::high_resolution_clock::time_point start) {
+		return (cl_ulong)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	};
+
+	//2 KB per private histogram, so threads only share cache lines at the edges of their copies
+	vector<cl_ulong> partial((size_t)threads * BIN_COUNT, 0);
+
+	auto start = std::chrono::high_resolution_clock::now();
+#pragma omp parallel num_threads(threads)
+	{
+#ifdef _OPENMP
+		int thread = omp_get_thread_num();
+		int count = omp_get_num_threads();
+#else
+		int thread = 0;
+		int count = 1;
+#endif
+		size_t begin = size * thread / count, end = size * (thread + 1) / count;
+		cl_ulong* local = &partial[(size_t)thread * BIN_COUNT];
+
+		for (size_t i = begin; i < end; i++)
+			local[input[i]]++;
+
+#pragma omp barrier
+
+		//at each level thread t adds the copy of thread t + stride to its own, thread 0 ends with the total
+		for (int stride = 1; stride < count; stride *= 2) {
+			if (thread % (2 * stride) == 0 && thread + stride < count) {
+				const cl_ulong* other = &partial[(size_t)(thread + stride) * BIN_COUNT];
+				for (int b = 0; b < BIN_COUNT; b++)
+					local[b] += other[b];
+			}
+#pragma omp barrier
+		}
+	}
+	histogram.assign(partial.begin(), partial.begin() + BIN_COUNT);
+	times.histogram = elapsed(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	ScanHistogram(histogram, cumulative);
+	times.scan = elapsed(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	ScaleLookUpTable(cumulative, lookUpTable);
+	times.lut = elapsed(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	const mytype* lut = lookUpTable.data();
+#pragma omp parallel num_threads(threads)
+	{
+#ifdef _OPENMP
+		int thread = omp_get_thread_num();
+		int count = omp_get_num_threads();
+#else
+		int thread = 0;
+		int count = 1;
+#endif
+		ptrdiff_t begin = (ptrdiff_t)(size * thread / count), end = (ptrdiff_t)(size * (thread + 1) / count);
+
+		//"omp simd" needs OpenMP 4.0, compilers without it still auto-vectorise the loop
+#if defined(_OPENMP) && _OPENMP >= 201307
+#pragma omp simd
+#endif
+		for (ptrdiff_t i = begin; i < end; i++)
+			output[i] = (unsigned char)lut[input[i]];
+	}
+	times.backProjection = elapsed(start);
+
+	return times;
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <cctype>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Utils.h"
+#include "CImg.h"
+
+//header of a binary 8-bit PGM (P5) file
+struct PgmHeader {
+	int width = 0;
+	int height = 0;
+	int maxValue = 0;
+	size_t dataOffset = 0; //bytes before the first pixel
+
+	size_t size() const { return (size_t)width * height; }
+};
+
+//parse the header at the start of 'data', returns false if it is not a P5 file with 8-bit pixels
+//fields are separated by whitespace and '#' comments, a single whitespace character ends the header
+bool ParsePgmHeader(const char* data, size_t length, PgmHeader& header) {
+	if (length < 2 || data[0] != 'P' || data[1] != '5')
+		return false;
+
+	size_t pos = 2;
+	int fields[3];
+
+	for (int& field : fields) {
+		while (pos < length && (isspace((unsigned char)data[pos]) || data[pos] == '#')) {
+			if (data[pos] == '#') {
+				while (pos < length && data[pos] != '\n')
+					pos++;
+			}
+			else
+				pos++;
+		}
+
+		if (pos >= length || !isdigit((unsigned char)data[pos]))
+			return false;
+
+		field = 0;
+		while (pos < length && isdigit((unsigned char)data[pos]))
+			field = field * 10 + (data[pos++] - '0');
+	}
+
+	if (pos >= length || !isspace((unsigned char)data[pos]))
+		return false;
+
+	header.width = fields[0];
+	header.height = fields[1];
+	header.maxValue = fields[2];
+	header.dataOffset = pos + 1;
+
+	return header.width > 0 && header.height > 0 && header.maxValue > 0 && header.maxValue < 256;
+}
+
+//a PGM file mapped into memory, the pixels are read in place instead of being decoded into a heap copy
+//the mapping is copy-on-write, so a runtime writing back to a CL_MEM_USE_HOST_PTR buffer never touches the file
+class MappedPgm {
+public:
+	MappedPgm() {}
+
+	~MappedPgm() { Close(); }
+
+	MappedPgm(const MappedPgm&) = delete;
+	MappedPgm& operator=(const MappedPgm&) = delete;
+
+	//map 'file_name', returns false if it can not be mapped or is not a complete binary 8-bit PGM
+	bool Open(const string& file_name) {
+		Close();
+
+#ifdef _WIN32
+		file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER file_size;
+		if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+			mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		if (mapping)
+			view = (char*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+		length = (size_t)file_size.QuadPart;
+#else
+		int fd = open(file_name.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat info;
+		if (fstat(fd, &info) == 0 && info.st_size > 0) {
+			length = (size_t)info.st_size;
+			void* address = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (address != MAP_FAILED) {
+				view = (char*)address;
+				madvise(address, length, MADV_SEQUENTIAL);
+			}
+		}
+		//the mapping stays valid after the descriptor is closed
+		close(fd);
+#endif
+
+		if (!view || !ParsePgmHeader(view, length, header) || header.dataOffset + header.size() > length) {
+			Close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void Close() {
+#ifdef _WIN32
+		if (view)
+			UnmapViewOfFile(view);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (view)
+			munmap(view, length);
+#endif
+		view = NULL;
+		length = 0;
+		header = PgmHeader();
+	}
+
+	bool IsOpen() const { return view != NULL; }
+
+	const PgmHeader& GetHeader() const { return header; }
+
+	//the pixel payload, header.size() bytes right after the header, so in general not page aligned (see IsPageAligned)
+	unsigned char* data() const { return (unsigned char*)view + header.dataOffset; }
+
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+	char* view = NULL;
+	size_t length = 0;
+	PgmHeader header;
+};
+
+//longest header PgmReader accepts, comments included
+const size_t PGM_MAX_HEADER = 64 << 10;
+
+//reads the pixels of a binary PGM in ranges, for images that do not fit into host memory
+class PgmReader {
+public:
+	PgmReader(const string& file_name) :
+		fileName(file_name),
+		file(file_name, ios::binary) {
+		vector<char> start(PGM_MAX_HEADER);
+		file.read(start.data(), start.size());
+		if (!ParsePgmHeader(start.data(), (size_t)file.gcount(), header))
+			throw cimg_library::CImgIOException("PgmReader: %s is not a binary 8-bit PGM file", file_name.c_str());
+		file.clear();
+	}
+
+	const PgmHeader& GetHeader() const { return header; }
+
+	//fill 'dst' with 'size' pixels starting at pixel 'offset'
+	void Read(size_t offset, size_t size, unsigned char* dst) {
+		file.seekg((streamoff)(header.dataOffset + offset));
+		file.read((char*)dst, size);
+		if ((size_t)file.gcount() != size)
+			throw cimg_library::CImgIOException("PgmReader: %s is truncated", fileName.c_str());
+	}
+
+private:
+	string fileName;
+	ifstream file;
+	PgmHeader header;
+};
+
+//writes a binary PGM in ranges, the header is written up front
+class PgmWriter {
+public:
+	PgmWriter(const string& file_name, int width, int height) :
+		fileName(file_name),
+		file(file_name, ios::binary | ios::trunc) {
+		file << "P5\n" << width << " " << height << "\n255\n";
+		dataOffset = (size_t)file.tellp();
+		if (!file)
+			throw cimg_library::CImgIOException("PgmWriter: can not write %s", file_name.c_str());
+	}
+
+	//write 'size' pixels from 'src' at pixel 'offset', ranges written in order do not seek
+	void Write(size_t offset, size_t size, const unsigned char* src) {
+		if ((size_t)file.tellp() != dataOffset + offset)
+			file.seekp((streamoff)(dataOffset + offset));
+		file.write((const char*)src, size);
+		if (!file)
+			throw cimg_library::CImgIOException("PgmWriter: can not write %s", fileName.c_str());
+	}
+
+private:
+	string fileName;
+	ofstream file;
+	size_t dataOffset = 0;
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "Equalizer.h"
+#include "TaskGraph.h"
+
+//bytes copied by the peak bandwidth measurement (read once and written once), limited by the device allocation size
+const size_t STREAM_COPY_SIZE = 64 << 20;
+
+//launches of the copy kernel, the fastest one is kept
+const int STREAM_COPY_REPETITIONS = 5;
+
+//attainable memory bandwidth of the device [GB/s], measured with the streamCopy kernel
+double MeasurePeakBandwidth(const cl::Context& context, const cl::Program& program) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+	cl::Kernel kernel(program, "streamCopy");
+
+	size_t size = std::min(STREAM_COPY_SIZE, (size_t)GetDeviceInfo(device).maxAllocSize) / sizeof(cl_uint4) * sizeof(cl_uint4);
+	size_t count = size / sizeof(cl_uint4);
+	cl::Buffer source(context, CL_MEM_READ_ONLY, size);
+	cl::Buffer destination(context, CL_MEM_WRITE_ONLY, size);
+	cl::Event filled;
+	queue.enqueueFillBuffer(source, (cl_uchar)1, 0, size, NULL, &filled);
+	TaskGraph::Observe("fill stream source", filled);
+
+	size_t local_size = GetLocalSize(kernel, queue);
+	kernel.setArg(0, source);
+	kernel.setArg(1, destination);
+	kernel.setArg(2, (cl_ulong)count);
+
+	cl_ulong best = ~(cl_ulong)0;
+	for (int r = 0; r < STREAM_COPY_REPETITIONS; r++) {
+		cl::Event evnt;
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(RoundUp(count, local_size)), cl::NDRange(local_size), NULL, &evnt);
+		TaskGraph::Observe("streamCopy", evnt);
+		evnt.wait();
+		best = std::min(best, GetExecutionTime(evnt));
+	}
+
+	return 2.0 * size / std::max((cl_ulong)1, best);
+}
+
+//memory traffic and work of one kernel launch, derived from the image size and the bin count
+//only the dominant terms are counted: pixels read and written, and the bins each stage touches
+struct KernelTraffic {
+	string name;
+	double bytes = 0.0;
+	double operations = 0.0;
+	double pixels = 0.0;
+	cl_ulong time = 0; //[ns]
+
+	double GetBandwidth() const { return time ? bytes / time : 0.0; } //[GB/s]
+	double GetPixelRate() const { return time ? pixels / time : 0.0; } //[Gpixel/s]
+	double GetIntensity() const { return bytes > 0.0 ? operations / bytes : 0.0; } //[op/B]
+};
+
+vector<KernelTraffic> GetEqualizerTraffic(size_t image_size, const EqualizerEvents& events) {
+	double bins = BIN_COUNT, bin_bytes = BIN_COUNT * sizeof(mytype), pixels = (double)image_size;
+	vector<KernelTraffic> traffic(4);
+
+	//one byte read and one increment per pixel
+	traffic[0].name = "histogram";
+	traffic[0].bytes = pixels;
+	traffic[0].operations = pixels;
+	traffic[0].pixels = pixels;
+	traffic[0].time = GetExecutionTime(events.histogram);
+
+	//bins read and written once, log2(bins) additions per bin
+	traffic[1].name = "scan";
+	traffic[1].bytes = 2.0 * bin_bytes;
+	traffic[1].operations = bins * 8.0;
+	traffic[1].time = GetExecutionTime(events.scan);
+
+	//one multiply and divide per bin
+	traffic[2].name = "LUT";
+	traffic[2].bytes = 2.0 * bin_bytes;
+	traffic[2].operations = 2.0 * bins;
+	traffic[2].time = GetExecutionTime(events.lut);
+
+	//one byte read, one lookup and one byte written per pixel
+	traffic[3].name = "back projection";
+	traffic[3].bytes = 2.0 * pixels;
+	traffic[3].operations = pixels;
+	traffic[3].pixels = pixels;
+	traffic[3].time = GetExecutionTime(events.backProjection);
+
+	return traffic;
+}
+
+//one line per kernel; with a measured peak (> 0) also the share of it each kernel attains
+//and the kernel with the most time left on the table, i.e. the stage worth optimising first
+string GetRooflineReport(const vector<KernelTraffic>& traffic, double peak_bandwidth) {
+	stringstream sstream;
+	const KernelTraffic* worst = NULL;
+	double worst_loss = 0.0;
+
+	for (const KernelTraffic& kernel : traffic) {
+		sstream << kernel.name << ": " << kernel.bytes << " [B], " << kernel.operations << " [op], " << kernel.GetIntensity() << " [op/B], ";
+		sstream << kernel.GetBandwidth() << " [GB/s]";
+		if (kernel.pixels > 0.0)
+			sstream << ", " << kernel.GetPixelRate() << " [Gpixel/s]";
+
+		if (peak_bandwidth > 0.0) {
+			sstream << ", " << 100.0 * kernel.GetBandwidth() / peak_bandwidth << "% of peak";
+
+			//time spent beyond what the peak bandwidth would need for the same bytes
+			double loss = kernel.time - kernel.bytes / peak_bandwidth;
+			if (loss > worst_loss) {
+				worst_loss = loss;
+				worst = &kernel;
+			}
+		}
+		sstream << endl;
+	}
+
+	if (peak_bandwidth > 0.0) {
+		sstream << "Peak (streamCopy): " << peak_bandwidth << " [GB/s]" << endl;
+		if (worst)
+			sstream << "Furthest from the roofline: " << worst->name << ", " << worst_loss / PROF_US << " [us] above the bandwidth bound" << endl;
+	}
+
+	return sstream.str();
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Equalizer.h"
+#include "ProgramCache.h"
+
+//programs of one kernel source built for different specializations, keyed by their build options
+//each variant is compiled once per process (and once per device thanks to the binary cache next to 'file_name'), then shared
+class KernelVariantCache {
+public:
+	KernelVariantCache(const cl::Context& context, const string& source, const string& file_name) :
+		context(context),
+		source(source),
+		fileName(file_name),
+		deviceOptions(GetDeviceBuildOptions(context)) {}
+
+	cl::Program Get(const KernelSpecialization& specialization) {
+		string options = specialization.GetBuildOptions();
+		if (!deviceOptions.empty())
+			options += (options.empty() ? "" : " ") + deviceOptions;
+
+		map<string, cl::Program>::iterator found = variants.find(options);
+		if (found != variants.end())
+			return found->second;
+
+		cl::Program program = BuildSourceCached(context, source, fileName, options);
+		variants[options] = program;
+		return program;
+	}
+
+	size_t size() const { return variants.size(); }
+
+private:
+	cl::Context context;
+	string source;
+	string fileName;
+	string deviceOptions;
+	map<string, cl::Program> variants;
+};
+
+//specializations compared by BenchmarkSpecialization, all for 8-bit images
+//replicated histograms that do not fit the local memory of the device (as little as 1 KB on embedded profiles) are left out
+vector<KernelSpecialization> GetSpecializationCandidates(const DeviceInfo& device) {
+	vector<KernelSpecialization> candidates;
+
+	for (int vector_width : { 1, 4, 16 }) {
+		for (int replication : { 1, 4 }) {
+			for (const char* lut_type : { "int", "uchar" }) {
+				KernelSpecialization candidate;
+				candidate.vectorWidth = vector_width;
+				candidate.replication = replication;
+				candidate.lutType = lut_type;
+				if ((cl_ulong)candidate.bins * candidate.replication * sizeof(cl_uint) <= device.localMemSize)
+					candidates.push_back(candidate);
+			}
+		}
+	}
+
+	return candidates;
+}
+
+//launches per variant, the fastest one is kept to filter out noise
+const int SPECIALIZATION_REPETITIONS = 5;
+
+//equalise 'image' with the generic kernels and with every candidate specialization,
+//reporting the best kernel times of each and checking that the specialized output matches the generic one
+void BenchmarkSpecialization(const cl::Context& context, KernelVariantCache& variants, const CImg<unsigned char>& image, ostream& log) {
+	cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+	size_t size = image.size();
+
+	EqualizerBuffers buffers;
+	buffers.Reserve(context, size);
+	queue.enqueueWriteBuffer(buffers.imageInput, CL_TRUE, 0, size, image.data());
+
+	vector<KernelSpecialization> candidates = GetSpecializationCandidates(GetDeviceInfo(context.getInfo<CL_CONTEXT_DEVICES>()[0]));
+	candidates.insert(candidates.begin(), KernelSpecialization());
+
+	vector<unsigned char> reference(size);
+	vector<unsigned char> output(size);
+	cl_ulong generic_total = 0;
+
+	for (const KernelSpecialization& candidate : candidates) {
+		EqualizerKernels kernels(variants.Get(candidate), TuningProfile(), candidate);
+		cl_ulong histogram = ~(cl_ulong)0, lut = ~(cl_ulong)0, projection = ~(cl_ulong)0;
+
+		for (int r = 0; r < SPECIALIZATION_REPETITIONS; r++) {
+			TaskGraph graph;
+			EqualizerEvents events;
+			EnqueueEqualize(graph, queue, kernels, buffers, size, {}, events);
+			graph.Wait();
+
+			histogram = std::min(histogram, GetExecutionTime(events.histogram));
+			lut = std::min(lut, GetExecutionTime(events.lut));
+			projection = std::min(projection, GetExecutionTime(events.backProjection));
+		}
+
+		queue.enqueueReadBuffer(buffers.imageOutput, CL_TRUE, 0, size, candidate.IsEnabled() ? output.data() : reference.data());
+
+		cl_ulong total = histogram + lut + projection;
+		if (!candidate.IsEnabled())
+			generic_total = total;
+
+		log << (candidate.IsEnabled() ? candidate.GetBuildOptions() : "generic");
+		log << ": Histogram " << histogram << ", LUT " << lut << ", Back projection " << projection << " [ns]";
+		if (candidate.IsEnabled()) {
+			log << ", speedup " << (double)generic_total / std::max((cl_ulong)1, total);
+			log << ((output == reference) ? ", output matches" : ", OUTPUT DIFFERS");
+		}
+		log << endl;
+	}
+
+	log << variants.size() << " program variant(s) built" << endl;
+}
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Equalizer.h"
+
+//images for a batch run: every file of a directory, every file matching a pattern ("scans/*.pgm"), or every frame of a video
+class ImageBatch {
+public:
+	ImageBatch(const string& path) {
+		bool pattern = path.find_first_of("*?") != string::npos;
+		if (pattern || cimg::is_directory(path.c_str())) {
+			CImgList<char> names = cimg::files(path.c_str(), pattern, 0, true);
+			for (unsigned int i = 0; i < names.size(); i++)
+				files.push_back(names[i].data());
+		}
+		else {
+			//video containers (and any other list format CImg understands) decode into frames
+			frames.load(path.c_str());
+		}
+	}
+
+	size_t size() const { return files.empty() ? frames.size() : files.size(); }
+
+	//files are decoded on demand so that only the images in flight are kept in host memory
+	CImg<unsigned char> Load(size_t index) const {
+		if (files.empty())
+			return frames[(unsigned int)index];
+		return CImg<unsigned char>(files[index].c_str());
+	}
+
+	//file name used when the equalised image is written out
+	string Name(size_t index) const {
+		if (files.empty()) {
+			char name[32];
+			snprintf(name, sizeof(name), "frame_%06u.pnm", (unsigned int)index);
+			return name;
+		}
+		return cimg::basename(files[index].c_str());
+	}
+
+private:
+	vector<string> files;
+	CImgList<unsigned char> frames;
+};
+
+//receives every equalised image of a batch with its index and the profiling events of its kernels
+typedef std::function<void(size_t index, const CImg<unsigned char>& output, const EqualizerEvents& events)> BatchConsumer;
+
+//number of buffer sets in rotation: one being uploaded, one being computed and one being downloaded
+const int STREAM_DEPTH = 3;
+
+//device busy time of each stage summed over the batch, against the device time from the first upload to the last download
+struct StreamStats {
+	size_t images = 0;
+	size_t bytes = 0;
+	cl_ulong upload = 0;
+	cl_ulong compute = 0;
+	cl_ulong download = 0;
+	cl_ulong span = 0;
+	double wall = 0.0; //host seconds
+};
+
+//streams a batch through separate upload, compute and download queues
+//image N+1 is uploaded while image N is equalised and image N-1 is read back, each in its own buffer set
+//stages are ordered only by events, so throughput is bound by the slowest stage rather than the sum of all three
+//with out-of-order queues the kernels of consecutive images may also overlap with each other
+//buffer sets are grown through a BufferPool, so no allocation happens once the batch has settled
+class StreamPipeline {
+public:
+	StreamPipeline(const cl::Context& context, const cl::Program& program, bool out_of_order = false, const TuningProfile& profile = TuningProfile()) :
+		pool(context),
+		uploadQueue(context, GetQueueProperties(context, out_of_order)),
+		computeQueue(context, GetQueueProperties(context, out_of_order)),
+		downloadQueue(context, GetQueueProperties(context, out_of_order)),
+		kernels(program, profile) {}
+
+	//equalise every image of the batch, 'consume' receives the results in batch order
+	StreamStats Run(const ImageBatch& batch, const BatchConsumer& consume) {
+		StreamStats stats;
+		first_start = ~(cl_ulong)0;
+		last_end = 0;
+
+		auto wall_start = std::chrono::high_resolution_clock::now();
+
+		for (size_t i = 0; i < batch.size(); i++) {
+			Slot& slot = slots[i % STREAM_DEPTH];
+
+			//the buffer set is free again once its previous image has been read back
+			if (slot.busy)
+				Retire(slot, stats, consume);
+
+			slot.index = i;
+			slot.input = batch.Load(i);
+			size_t image_size = slot.input.size();
+			slot.output.assign(slot.input.width(), slot.input.height(), slot.input.depth(), slot.input.spectrum());
+			slot.buffers.Reserve(pool, image_size);
+
+			slot.graph.Clear();
+			TaskGraph::Node uploaded = slot.graph.Add("upload", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				uploadQueue.enqueueWriteBuffer(slot.buffers.imageInput, CL_FALSE, 0, image_size, slot.input.data(), wait, done);
+			});
+
+			TaskGraph::Node computed = EnqueueEqualize(slot.graph, computeQueue, kernels, slot.buffers, image_size, { uploaded }, slot.compute);
+
+			TaskGraph::Node downloaded = slot.graph.Add("download", { computed }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				downloadQueue.enqueueReadBuffer(slot.buffers.imageOutput, CL_FALSE, 0, image_size, slot.output.data(), wait, done);
+			});
+
+			slot.upload = slot.graph.GetEvent(uploaded);
+			slot.download = slot.graph.GetEvent(downloaded);
+
+			//start the device on this image while the host decodes the next one
+			uploadQueue.flush();
+			computeQueue.flush();
+			downloadQueue.flush();
+			slot.busy = true;
+		}
+
+		//drain the remaining images in order
+		for (size_t i = batch.size(); i < batch.size() + STREAM_DEPTH; i++) {
+			Slot& slot = slots[i % STREAM_DEPTH];
+			if (slot.busy)
+				Retire(slot, stats, consume);
+		}
+
+		stats.wall = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - wall_start).count();
+		stats.span = (last_end > first_start) ? last_end - first_start : 0;
+
+		return stats;
+	}
+
+	//device memory of the slots, kept between batches
+	const BufferPool& GetPool() const { return pool; }
+
+private:
+	struct Slot {
+		EqualizerBuffers buffers;
+		//host images stay alive until the transfers reading from/writing to them have completed
+		CImg<unsigned char> input;
+		CImg<unsigned char> output;
+		TaskGraph graph;
+		cl::Event upload;
+		EqualizerEvents compute;
+		cl::Event download;
+		size_t index = 0;
+		bool busy = false;
+	};
+
+	void Retire(Slot& slot, StreamStats& stats, const BatchConsumer& consume) {
+		slot.download.wait();
+
+		stats.images++;
+		stats.bytes += slot.input.size();
+		stats.upload += GetExecutionTime(slot.upload);
+		stats.compute += GetExecutionTime(slot.compute.histogram) + GetExecutionTime(slot.compute.scan) +
+			GetExecutionTime(slot.compute.lut) + GetExecutionTime(slot.compute.backProjection);
+		stats.download += GetExecutionTime(slot.download);
+
+		first_start = std::min(first_start, slot.upload.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+		last_end = std::max(last_end, slot.download.getProfilingInfo<CL_PROFILING_COMMAND_END>());
+
+		consume(slot.index, slot.output, slot.compute);
+		slot.busy = false;
+	}
+
+	BufferPool pool;
+	cl::CommandQueue uploadQueue;
+	cl::CommandQueue computeQueue;
+	cl::CommandQueue downloadQueue;
+	EqualizerKernels kernels;
+	Slot slots[STREAM_DEPTH];
+	cl_ulong first_start = 0;
+	cl_ulong last_end = 0;
+};
+
+//overlap efficiency is 0 when the stages ran back to back (span == sum of stages)
+//and 1 when the span shrank to the slowest stage, the best a three stage pipeline can do
+string GetStreamReport(const StreamStats& stats) {
+	stringstream sstream;
+
+	cl_ulong serial = stats.upload + stats.compute + stats.download;
+	cl_ulong bound = std::max(stats.upload, std::max(stats.compute, stats.download));
+	double efficiency = 1.0;
+	if (serial > bound)
+		efficiency = std::min(1.0, std::max(0.0, (double)((cl_long)serial - (cl_long)stats.span) / (double)(serial - bound)));
+
+	sstream << "Images: " << stats.images << ", " << stats.bytes << " [B]" << endl;
+	sstream << "Upload " << stats.upload / PROF_US << ", Compute " << stats.compute / PROF_US << ", Download " << stats.download / PROF_US << " [us]" << endl;
+	sstream << "Serial " << serial / PROF_US << ", Slowest stage " << bound / PROF_US << ", Pipelined span " << stats.span / PROF_US << " [us]" << endl;
+	sstream << "Overlap efficiency: " << efficiency * 100.0 << "%" << endl;
+	if (stats.wall > 0.0)
+		sstream << "Throughput: " << stats.images / stats.wall << " images/s, " << stats.bytes / stats.wall / 1e6 << " MB/s" << endl;
+
+	return sstream.str();
+}
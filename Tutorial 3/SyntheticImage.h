@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+#include "CImg.h"
+
+using namespace cimg_library;
+
+//intensity distributions of generated images, chosen to stress different parts of the pipeline
+enum SyntheticDistribution {
+	SYNTHETIC_UNIFORM, //every bin equally likely: spread atomics, flat LUT
+	SYNTHETIC_SPIKE, //99% of the pixels in one bin: worst case contention on a single counter
+	SYNTHETIC_BIMODAL, //two narrow peaks: typical of underexposed scans, a few hot bins
+	SYNTHETIC_GRADIENT //smooth gradients with mild noise: close to natural images
+};
+
+struct SyntheticImageOptions {
+	int width = 1024;
+	int height = 1024;
+	int channels = 1; //1 for grayscale (PGM), 3 for RGB (PPM)
+	SyntheticDistribution distribution = SYNTHETIC_UNIFORM;
+	cl_ulong seed = 1;
+};
+
+//parse "WxH[,distribution][,rgb]", e.g. "32768x32768,bimodal,rgb"
+bool ParseSyntheticSpec(const string& spec, SyntheticImageOptions& options) {
+	stringstream fields(spec);
+	string field;
+
+	if (!getline(fields, field, ',') || sscanf(field.c_str(), "%dx%d", &options.width, &options.height) != 2 || options.width <= 0 || options.height <= 0)
+		return false;
+
+	while (getline(fields, field, ',')) {
+		if (field == "uniform") options.distribution = SYNTHETIC_UNIFORM;
+		else if (field == "spike") options.distribution = SYNTHETIC_SPIKE;
+		else if (field == "bimodal") options.distribution = SYNTHETIC_BIMODAL;
+		else if (field == "gradient") options.distribution = SYNTHETIC_GRADIENT;
+		else if (field == "rgb") options.channels = 3;
+		else if (field == "gray") options.channels = 1;
+		else return false;
+	}
+
+	return true;
+}
+
+//stateless 64-bit mix (splitmix64), so any pixel can be generated independently of the others
+//and bands of a huge image can be produced in any order with the same result
+cl_ulong MixBits(cl_ulong value) {
+	value += 0x9E3779B97F4A7C15ULL;
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+	return value ^ (value >> 31);
+}
+
+unsigned char GetSyntheticPixel(const SyntheticImageOptions& options, int x, int y, int channel) {
+	cl_ulong index = ((cl_ulong)y * options.width + x) * options.channels + channel;
+	cl_ulong bits = MixBits(index ^ MixBits(options.seed));
+
+	switch (options.distribution) {
+	case SYNTHETIC_SPIKE:
+		return (bits % 100) ? 128 : (unsigned char)(bits >> 8);
+	case SYNTHETIC_BIMODAL: {
+		//sum of four uniform bytes, roughly normal, scaled to a standard deviation of about 16 around either peak
+		int sum = (int)((bits >> 8) & 0xFF) + (int)((bits >> 16) & 0xFF) + (int)((bits >> 24) & 0xFF) + (int)((bits >> 32) & 0xFF);
+		int peak = (bits & 1) ? 192 : 64;
+		return (unsigned char)std::min(255, std::max(0, peak + (sum - 510) * 16 / 148));
+	}
+	case SYNTHETIC_GRADIENT: {
+		const double pi = 3.14159265358979323846;
+		double u = (double)x / options.width, v = (double)y / options.height;
+		double value = 128.0 + 90.0 * std::sin(2.0 * pi * (1.5 * u + 0.3 * channel)) * std::cos(pi * v) + 30.0 * (u - v);
+		int noise = (int)(bits & 0xF) - 8;
+		return (unsigned char)std::min(255, std::max(0, (int)value + noise));
+	}
+	default:
+		return (unsigned char)bits;
+	}
+}
+
+//generate the image in memory, channels stored as separate planes as CImg does
+CImg<unsigned char> GenerateSyntheticImage(const SyntheticImageOptions& options) {
+	CImg<unsigned char> image(options.width, options.height, 1, options.channels);
+
+	cimg_forXYC(image, x, y, c)
+		image(x, y, 0, c) = GetSyntheticPixel(options, x, y, c);
+
+	return image;
+}
+
+//rows generated per write by WriteSyntheticImage
+const int SYNTHETIC_BAND_ROWS = 256;
+
+//write the image as a binary PGM (grayscale) or PPM (RGB, interleaved) one band of rows at a time,
+//so gigapixel images can be produced without holding them in memory
+void WriteSyntheticImage(const string& file_name, const SyntheticImageOptions& options) {
+	ofstream file(file_name, ios::binary | ios::trunc);
+	file << (options.channels == 3 ? "P6" : "P5") << "\n" << options.width << " " << options.height << "\n255\n";
+
+	vector<unsigned char> band((size_t)options.width * options.channels * SYNTHETIC_BAND_ROWS);
+
+	for (int first_row = 0; first_row < options.height; first_row += SYNTHETIC_BAND_ROWS) {
+		int rows = std::min(SYNTHETIC_BAND_ROWS, options.height - first_row);
+		size_t i = 0;
+		for (int y = first_row; y < first_row + rows; y++)
+			for (int x = 0; x < options.width; x++)
+				for (int c = 0; c < options.channels; c++)
+					band[i++] = GetSyntheticPixel(options, x, y, c);
+		file.write((const char*)band.data(), i);
+	}
+
+	if (!file)
+		throw CImgIOException("WriteSyntheticImage: can not write %s", file_name.c_str());
+}
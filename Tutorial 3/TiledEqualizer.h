@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <functional>
+#include <vector>
+
+#include "Equalizer.h"
+
+//host side of the tiles: the reader fills 'dst' with 'size' pixels starting at 'offset',
+//the writer receives the equalised pixels of the same range
+typedef std::function<void(size_t offset, size_t size, unsigned char* dst)> TileReader;
+typedef std::function<void(size_t offset, size_t size, const unsigned char* src)> TileWriter;
+
+//tile size used when an image does not fit into a single device allocation
+const size_t DEFAULT_TILE_SIZE = 16 << 20;
+
+//device time of each pass, from the first upload to the last command of the pass
+struct TiledStats {
+	size_t tiles = 0;
+	size_t tileSize = 0;
+	cl_ulong histogramPass = 0;
+	cl_ulong projectionPass = 0;
+};
+
+//LUT of a histogram with 64-bit counts, scaled like the LUT kernel
+void BuildLookUpTable(const vector<cl_ulong>& histogram, vector<mytype>& lookUpTable) {
+	vector<cl_ulong> cumulative;
+	ScanHistogram(histogram, cumulative);
+	ScaleLookUpTable(cumulative, lookUpTable);
+}
+
+//largest tile whose 32-bit histogram can not overflow, even if every pixel falls into one bin
+const size_t MAX_TILE_SIZE = INT_MAX;
+
+//equalises images larger than CL_DEVICE_MAX_MEM_ALLOC_SIZE with a fixed amount of device memory
+//pass 1 streams the tiles through the histogram kernel, each tile into its own 32-bit histogram that is read back
+//and added to 64-bit counts on the host, so images of any number of pixels are counted exactly;
+//the LUT is then built once on the host and pass 2 streams the tiles again through the back projection
+//two tile slots are used in turn, so the transfers of one tile overlap the kernel of the other,
+//and each slot records the commands of its current tile only, so the host state does not grow with the image
+class TiledEqualizer {
+public:
+	TiledEqualizer(const cl::Context& context, const cl::Program& program, size_t tile_size, const TuningProfile& profile = TuningProfile()) :
+		uploadQueue(context, CL_QUEUE_PROFILING_ENABLE),
+		computeQueue(context, CL_QUEUE_PROFILING_ENABLE),
+		downloadQueue(context, CL_QUEUE_PROFILING_ENABLE),
+		kernels(program, profile),
+		tileSize(std::max((size_t)1, std::min(tile_size, MAX_TILE_SIZE))) {
+		buffers.Reserve(context, 0);
+
+		for (Slot& slot : slots) {
+			slot.input = cl::Buffer(context, CL_MEM_READ_ONLY, tileSize);
+			slot.output = cl::Buffer(context, CL_MEM_WRITE_ONLY, tileSize);
+			slot.histogram = cl::Buffer(context, CL_MEM_READ_WRITE, BIN_COUNT * sizeof(mytype));
+			slot.hostInput.Allocate(tileSize);
+			slot.hostOutput.Allocate(tileSize);
+			slot.hostHistogram.resize(BIN_COUNT);
+		}
+	}
+
+	TiledStats Run(size_t image_size, const TileReader& read, const TileWriter& write) {
+		TiledStats stats;
+		size_t tiles = (image_size + tileSize - 1) / tileSize;
+		cl::Event first_upload;
+
+		stats.tiles = tiles;
+		stats.tileSize = tileSize;
+
+		//pass 1 - histogram
+		vector<cl_ulong> histogram(BIN_COUNT, 0);
+
+		for (size_t k = 0; k < tiles; k++) {
+			Slot& slot = slots[k % 2];
+			size_t offset = k * tileSize;
+			size_t size = std::min(tileSize, image_size - offset);
+
+			//the slot is free once the histogram of the tile two steps back has been read and counted
+			if (slot.busy)
+				Count(slot, histogram);
+
+			read(offset, size, slot.hostInput.data());
+
+			slot.graph.Clear();
+			TaskGraph::Node cleared = slot.graph.Add("clear histogram", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				computeQueue.enqueueFillBuffer(slot.histogram, 0, 0, BIN_COUNT * sizeof(mytype), wait, done);
+			});
+			TaskGraph::Node uploaded = slot.graph.Add("upload tile", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				uploadQueue.enqueueWriteBuffer(slot.input, CL_FALSE, 0, size, slot.hostInput.data(), wait, done);
+			});
+			if (k == 0)
+				first_upload = slot.graph.GetEvent(uploaded);
+
+			TaskGraph::Node counted = EnqueueHistogram(slot.graph, computeQueue, kernels, slot.input, slot.histogram, size, { cleared, uploaded });
+			TaskGraph::Node downloaded = slot.graph.Add("read histogram", { counted }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				downloadQueue.enqueueReadBuffer(slot.histogram, CL_FALSE, 0, BIN_COUNT * sizeof(mytype), slot.hostHistogram.data(), wait, done);
+			});
+			slot.last = slot.graph.GetEvent(downloaded);
+			slot.busy = true;
+
+			uploadQueue.flush();
+			computeQueue.flush();
+			downloadQueue.flush();
+		}
+
+		for (Slot& slot : slots)
+			if (slot.busy)
+				Count(slot, histogram);
+
+		//the LUT of the whole image, uploaded once for every tile of pass 2
+		vector<mytype> lookUpTable;
+		BuildLookUpTable(histogram, lookUpTable);
+
+		TaskGraph lut_graph;
+		TaskGraph::Node uploaded_lut = lut_graph.Add("upload LUT", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+			uploadQueue.enqueueWriteBuffer(buffers.lookUpTable, CL_FALSE, 0, BIN_COUNT * sizeof(mytype), lookUpTable.data(), wait, done);
+		});
+		cl::Event lut = lut_graph.GetEvent(uploaded_lut);
+		lut.wait();
+
+		if (tiles)
+			stats.histogramPass = lut.getProfilingInfo<CL_PROFILING_COMMAND_END>() - first_upload.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+
+		//pass 2 - back projection with the LUT of the whole image
+		for (size_t k = 0; k < tiles; k++) {
+			Slot& slot = slots[k % 2];
+			size_t offset = k * tileSize;
+			size_t size = std::min(tileSize, image_size - offset);
+
+			//hand the tile two steps back to the writer before its slot is reused
+			if (slot.pending)
+				Retire(slot, write);
+
+			read(offset, size, slot.hostInput.data());
+
+			slot.graph.Clear();
+			TaskGraph::Node lut_ready = slot.graph.AddEvent("LUT", lut);
+			TaskGraph::Node uploaded = slot.graph.Add("upload tile", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				uploadQueue.enqueueWriteBuffer(slot.input, CL_FALSE, 0, size, slot.hostInput.data(), wait, done);
+			});
+			if (k == 0)
+				first_upload = slot.graph.GetEvent(uploaded);
+
+			TaskGraph::Node projected = EnqueueBackProjection(slot.graph, computeQueue, kernels, slot.input, buffers.lookUpTable, slot.output, size, { lut_ready, uploaded });
+
+			TaskGraph::Node downloaded = slot.graph.Add("download tile", { projected }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				downloadQueue.enqueueReadBuffer(slot.output, CL_FALSE, 0, size, slot.hostOutput.data(), wait, done);
+			});
+			slot.last = slot.graph.GetEvent(downloaded);
+			slot.offset = offset;
+			slot.size = size;
+			slot.pending = true;
+
+			uploadQueue.flush();
+			computeQueue.flush();
+			downloadQueue.flush();
+		}
+
+		cl_ulong last_end = 0;
+		for (size_t k = tiles; k < tiles + 2; k++) {
+			Slot& slot = slots[k % 2];
+			if (slot.pending) {
+				Retire(slot, write);
+				last_end = std::max(last_end, slot.last.getProfilingInfo<CL_PROFILING_COMMAND_END>());
+			}
+		}
+
+		if (tiles)
+			stats.projectionPass = last_end - first_upload.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+
+		return stats;
+	}
+
+private:
+	struct Slot {
+		cl::Buffer input;
+		cl::Buffer output;
+		cl::Buffer histogram;
+		AlignedHostBuffer hostInput;
+		AlignedHostBuffer hostOutput;
+		vector<mytype> hostHistogram;
+		TaskGraph graph; //commands of the tile in the slot
+		cl::Event last;
+		size_t offset = 0;
+		size_t size = 0;
+		bool busy = false;
+		bool pending = false;
+	};
+
+	void Count(Slot& slot, vector<cl_ulong>& histogram) {
+		slot.last.wait();
+		for (int i = 0; i < BIN_COUNT; i++)
+			histogram[i] += (cl_uint)slot.hostHistogram[i];
+		slot.busy = false;
+	}
+
+	void Retire(Slot& slot, const TileWriter& write) {
+		slot.last.wait();
+		write(slot.offset, slot.size, slot.hostOutput.data());
+		slot.pending = false;
+	}
+
+	cl::CommandQueue uploadQueue;
+	cl::CommandQueue computeQueue;
+	cl::CommandQueue downloadQueue;
+	EqualizerKernels kernels;
+	EqualizerBuffers buffers;
+	Slot slots[2];
+	size_t tileSize;
+};
+
+string GetTiledReport(const TiledStats& stats) {
+	stringstream sstream;
+
+	sstream << "Tiles: " << stats.tiles << " of " << stats.tileSize << " [B]" << endl;
+	sstream << "Histogram pass " << stats.histogramPass / PROF_US << ", Back projection pass " << stats.projectionPass / PROF_US << " [us]" << endl;
+
+	return sstream.str();
+}
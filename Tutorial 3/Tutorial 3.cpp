@@ -11,20 +11,140 @@
 *
 */
 
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <vector>
 
+//build with HEADLESS defined to compile out CImgDisplay, so the binary does not depend on X11/GDI
+#ifdef HEADLESS
+#define cimg_display 0
+#endif
+
 #include "Utils.h"
 #include "CImg.h"
+#include "Equalizer.h"
+#include "StreamPipeline.h"
+#include "TiledEqualizer.h"
+#include "MultiDevice.h"
+#include "Autotuner.h"
+#include "ProgramCache.h"
+#include "KernelSource.h"
+#include "TraceRecorder.h"
+#include "HostTimers.h"
+#include "Specialization.h"
+#include "PgmFile.h"
+#include "BatchWorkers.h"
+#include "AsyncEqualizer.h"
+#include "Benchmark.h"
+#include "SyntheticImage.h"
+#include "Verification.h"
+#include "Roofline.h"
+#include "OpenMPEqualizer.h"
 
 using namespace cimg_library;
 
+//zero-copy is chosen automatically from CL_DEVICE_HOST_UNIFIED_MEMORY unless forced
+enum CopyMode {
+	COPY_AUTO,
+	COPY_NEVER,
+	COPY_ALWAYS
+};
+
+//how much a run prints: normal gives one execution time per kernel and the summary of each mode, debug adds
+//the profiling breakdown, roofline, task graph and pool reports and the vectors,
+//stats replaces all other output with one JSON record per image (reports of other modes are dropped)
+enum Verbosity {
+	VERBOSITY_STATS,
+	VERBOSITY_NORMAL,
+	VERBOSITY_DEBUG
+};
+
+//one JSON line for -v stats, stage times [ns] summed over the channels (0 for stages run on the host)
+string GetImageStats(const string& name, int width, int height, size_t channels, cl_ulong histogram, cl_ulong scan, cl_ulong lut, cl_ulong back_projection) {
+	stringstream sstream;
+	sstream << "{\"image\": \"" << EscapeJson(name) << "\", \"width\": " << width << ", \"height\": " << height << ", \"channels\": " << channels;
+	sstream << ", \"histogram_ns\": " << histogram << ", \"scan_ns\": " << scan << ", \"lut_ns\": " << lut << ", \"back_projection_ns\": " << back_projection;
+	sstream << ", \"kernels_ns\": " << histogram + scan + lut + back_projection << "}" << endl;
+
+	return sstream.str();
+}
+
+string GetImageStats(const string& name, const CImg<unsigned char>& image, const vector<EqualizerEvents>& events) {
+	cl_ulong histogram = 0, scan = 0, lut = 0, back_projection = 0;
+	for (const EqualizerEvents& channel : events) {
+		histogram += GetExecutionTime(channel.histogram);
+		scan += GetExecutionTime(channel.scan);
+		lut += GetExecutionTime(channel.lut);
+		back_projection += GetExecutionTime(channel.backProjection);
+	}
+
+	return GetImageStats(name, image.width(), image.height(), events.size(), histogram, scan, lut, back_projection);
+}
+
+//write the equalised image if an output file was given and, unless running headless,
+//show it next to the input until one of the windows is closed or ESC is pressed
+void ShowResult(const CImg<unsigned char>& image_input, const CImg<unsigned char>& output_image, const string& output_path, bool headless) {
+	if (!output_path.empty()) {
+		ScopedTimer timer("save output");
+		output_image.save(output_path.c_str());
+	}
+
+	if (headless)
+		return;
+
+#if cimg_display
+	ScopedTimer timer("display");
+	CImgDisplay disp_input(image_input, "input");
+	CImgDisplay disp_output(output_image, "output");
+
+	while (!disp_input.is_closed() && !disp_output.is_closed()
+		&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
+		disp_input.wait(1);
+		disp_output.wait(1);
+	}
+#else
+	//built without a display (HEADLESS), the input is only shown when there is one
+	(void)image_input;
+#endif
+}
+
 void print_help() {
 	std::cerr << "Application usage:" << std::endl;
 
 	std::cerr << "  -p : select platform " << std::endl;
 	std::cerr << "  -d : select device" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
+	std::cerr << "  -i : input image (default test.pgm)" << std::endl;
+	std::cerr << "  -gen : use a generated image instead of -i, given as WxH[,uniform|spike|bimodal|gradient][,rgb]" << std::endl;
+	std::cerr << "  -seed : seed of the generated image (default 1)" << std::endl;
+	std::cerr << "  -genout : write the generated image to this PGM/PPM file and exit" << std::endl;
+	std::cerr << "  -b : equalise a batch (directory, file pattern such as \"scans/*.pgm\", or a video) through the streaming pipeline" << std::endl;
+	std::cerr << "  -threads : equalise the batch with this many worker threads, each with its own queue" << std::endl;
+	std::cerr << "  -async : equalise the batch through the asynchronous API, keeping up to " << ASYNC_IN_FLIGHT << " images in flight" << std::endl;
+	std::cerr << "  -o : output image, or output directory for a batch" << std::endl;
+	std::cerr << "  -decode : decode binary PGM input with CImg instead of mapping the file" << std::endl;
+	std::cerr << "  -headless : do not open any window (always on when built with HEADLESS)" << std::endl;
+	std::cerr << "  -ooo : use out-of-order command queues so independent tasks can overlap" << std::endl;
+	std::cerr << "  -omp : equalise on the host with the OpenMP engine (OMP_NUM_THREADS threads), or add it to -bench" << std::endl;
+	std::cerr << "  -c : equalise colour channels independently" << std::endl;
+	std::cerr << "  -zc : force zero-copy host buffers (default when the device shares memory with the host)" << std::endl;
+	std::cerr << "  -copy : force explicit copies to and from the device" << std::endl;
+	std::cerr << "  -tile : process the image in tiles of the given size in bytes (automatic above the device allocation limit)" << std::endl;
+	std::cerr << "  -stream : stream a binary PGM larger than host memory from the input file to the -o file in row bands (of -tile bytes)" << std::endl;
+	std::cerr << "  -md : split the image across all devices of the selected platform" << std::endl;
+	std::cerr << "  -tune : tune work-group sizes and coarsening on the input image and save them for this device" << std::endl;
+	std::cerr << "  -spec : benchmark kernels specialized at compile time against the generic ones on the input image" << std::endl;
+	std::cerr << "  -bench : benchmark the pipeline on the input image, the report goes to the -o file if given" << std::endl;
+	std::cerr << "  -warmup, -reps : untimed and timed runs of every benchmark configuration (default 3 and 20)" << std::endl;
+	std::cerr << "  -sizes : image sizes to benchmark, e.g. 1024x683,4096x4096 (default: input image size)" << std::endl;
+	std::cerr << "  -locals : local sizes to benchmark, 0 for the untuned launch (default 0,64,128,256)" << std::endl;
+	std::cerr << "  -format : benchmark report format: text, csv or json" << std::endl;
+	std::cerr << "  -verify : check every kernel variant against the host reference on synthetic images (or the -gen image, streamed through -tile sized tiles above 2^31 pixels)" << std::endl;
+	std::cerr << "  -roofline : compare the bandwidth of every kernel with the peak measured by a copy kernel" << std::endl;
+	std::cerr << "  -kernels : build the kernels from this file instead of the copy embedded at build time" << std::endl;
+	std::cerr << "  -trace : write every profiled command of the run to this file as a Chrome trace (chrome://tracing)" << std::endl;
+	std::cerr << "  -v : output: normal (default, kernel times and summaries), debug (also profiling details, roofline, task graph and pool reports, histogram, cumulative histogram and LUT) or stats (one JSON line per image on stdout, nothing else)" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
@@ -33,197 +153,630 @@ int main(int argc, char **argv) {
 	int platform_id = 0;
 	int device_id = 0;
 	string image_filename= "test.pgm";
-
+	string batch_path;
+	string output_path;
+	bool out_of_order = false;
+	bool per_channel = false;
+	CopyMode copy_mode = COPY_AUTO;
+	size_t tile_size = 0;
+	bool multi_device = false;
+	bool tune = false;
+	bool benchmark_specialization = false;
+	bool map_input = true;
+	bool stream_input = false;
+	int threads = 0;
+	bool async = false;
+	bool benchmark = false;
+	BenchmarkOptions benchmark_options;
+	bool synthetic = false;
+	SyntheticImageOptions synthetic_options;
+	string synthetic_output;
+	bool verify = false;
+	string trace_path;
+	string kernel_file;
+	bool roofline = false;
+	Verbosity verbosity = VERBOSITY_NORMAL;
+	bool openmp = false;
+#ifdef HEADLESS
+	bool headless = true;
+#else
+	bool headless = false;
+#endif
+
+	ScopedTimer parse_timer("parse arguments");
 	for (int i = 1; i < argc; i++)	{
 		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+		else if ((strcmp(argv[i], "-i") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-gen") == 0) && (i < (argc - 1))) {
+			synthetic = ParseSyntheticSpec(argv[++i], synthetic_options);
+			if (!synthetic) { std::cerr << "Invalid synthetic image " << argv[i] << std::endl; print_help(); return 1; }
+		}
+		else if ((strcmp(argv[i], "-seed") == 0) && (i < (argc - 1))) { synthetic_options.seed = strtoull(argv[++i], NULL, 10); }
+		else if ((strcmp(argv[i], "-genout") == 0) && (i < (argc - 1))) { synthetic_output = argv[++i]; }
+		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { batch_path = argv[++i]; }
+		else if ((strcmp(argv[i], "-threads") == 0) && (i < (argc - 1))) { threads = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-async") == 0) { async = true; }
+		else if (strcmp(argv[i], "-headless") == 0) { headless = true; }
+		else if (strcmp(argv[i], "-decode") == 0) { map_input = false; }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_path = argv[++i]; }
+		else if (strcmp(argv[i], "-ooo") == 0) { out_of_order = true; }
+		else if (strcmp(argv[i], "-c") == 0) { per_channel = true; }
+		else if (strcmp(argv[i], "-omp") == 0) { openmp = true; benchmark_options.openmp = true; }
+		else if ((strcmp(argv[i], "-tile") == 0) && (i < (argc - 1))) { tile_size = strtoull(argv[++i], NULL, 10); }
+		else if (strcmp(argv[i], "-tune") == 0) { tune = true; }
+		else if (strcmp(argv[i], "-spec") == 0) { benchmark_specialization = true; }
+		else if (strcmp(argv[i], "-md") == 0) { multi_device = true; }
+		else if (strcmp(argv[i], "-stream") == 0) { stream_input = true; }
+		else if (strcmp(argv[i], "-zc") == 0) { copy_mode = COPY_NEVER; }
+		else if (strcmp(argv[i], "-copy") == 0) { copy_mode = COPY_ALWAYS; }
+		else if (strcmp(argv[i], "-bench") == 0) { benchmark = true; }
+		else if (strcmp(argv[i], "-verify") == 0) { verify = true; }
+		else if (strcmp(argv[i], "-roofline") == 0) { roofline = true; }
+		else if ((strcmp(argv[i], "-trace") == 0) && (i < (argc - 1))) { trace_path = argv[++i]; }
+		else if ((strcmp(argv[i], "-kernels") == 0) && (i < (argc - 1))) { kernel_file = argv[++i]; }
+		else if ((strcmp(argv[i], "-warmup") == 0) && (i < (argc - 1))) { benchmark_options.warmUp = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-reps") == 0) && (i < (argc - 1))) { benchmark_options.repetitions = std::max(1, atoi(argv[++i])); }
+		else if ((strcmp(argv[i], "-sizes") == 0) && (i < (argc - 1))) {
+			stringstream list(argv[++i]);
+			string size;
+			int width, height;
+			while (getline(list, size, ','))
+				if (sscanf(size.c_str(), "%dx%d", &width, &height) == 2)
+					benchmark_options.sizes.push_back(make_pair(width, height));
+		}
+		else if ((strcmp(argv[i], "-locals") == 0) && (i < (argc - 1))) {
+			stringstream list(argv[++i]);
+			string local_size;
+			benchmark_options.localSizes.clear();
+			while (getline(list, local_size, ','))
+				benchmark_options.localSizes.push_back(strtoull(local_size.c_str(), NULL, 10));
+		}
+		else if ((strcmp(argv[i], "-format") == 0) && (i < (argc - 1))) { benchmark_options.format = argv[++i]; }
+		else if ((strcmp(argv[i], "-v") == 0) && (i < (argc - 1))) {
+			string level = argv[++i];
+			if (level == "stats") verbosity = VERBOSITY_STATS;
+			else if (level == "normal") verbosity = VERBOSITY_NORMAL;
+			else if (level == "debug") verbosity = VERBOSITY_DEBUG;
+			else { std::cerr << "Invalid verbosity " << level << std::endl; print_help(); return 1; }
+		}
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0;}
 	}
+	parse_timer.Stop();
+
+	//progress and reports of the run, swallowed by a stream without buffer when only stats are wanted
+	std::ostream quiet(NULL);
+	std::ostream& info = (verbosity == VERBOSITY_STATS) ? quiet : std::cout;
 
 	//detect any potential exceptions
 	try {
-		//Part 1 - Load Image
-		CImg<unsigned char> image_input(image_filename.c_str());
-		CImgDisplay disp_input(image_input, "input");
-		
+		//wall time of the host phases from process start, reported when main returns (after the trace is written)
+		HostProfileReport host_report(info);
+
+		//records every command from here on and writes the timeline when main returns
+		TraceRecorder trace(trace_path);
+
+		//write a synthetic image for later runs, no device needed
+		if (!synthetic_output.empty()) {
+			ScopedTimer timer("generate image");
+			WriteSyntheticImage(synthetic_output, synthetic_options);
+			info << "Generated " << synthetic_output << std::endl;
+			return 0;
+		}
+
+		//the input image: generated in memory with -gen, otherwise decoded from the -i file
+		auto load_input = [&]() {
+			ScopedTimer timer(synthetic ? "generate image" : "decode image");
+			return synthetic ? GenerateSyntheticImage(synthetic_options) : CImg<unsigned char>(image_filename.c_str());
+		};
+
+		//the OpenMP engine runs on the host alone, no device is needed unless it is benchmarked against one
+		if (openmp && !benchmark) {
+			CImg<unsigned char> image_input = load_input();
+			CImg<unsigned char> output_image(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+			int channels = per_channel ? image_input.spectrum() : 1;
+			size_t plane_size = image_input.size() / channels;
+			vector<OpenMPTimes> times(channels);
+
+			for (int c = 0; c < channels; c++) {
+				ScopedTimer timer("equalize on host");
+				vector<cl_ulong> intensityHistogram, cumulativeHistogram;
+				vector<mytype> lookUpTable;
+				times[c] = EqualizeOpenMP(image_input.data() + c*plane_size, output_image.data() + c*plane_size, plane_size, intensityHistogram, cumulativeHistogram, lookUpTable);
+				timer.Stop();
+
+				if (channels > 1)
+					info << "Channel " << c << std::endl;
+				if (verbosity == VERBOSITY_DEBUG) {
+					info << "Intensity Histogram Values : " << intensityHistogram << std::endl;
+					info << "Cumulative Histogram data = " << cumulativeHistogram << std::endl;
+					info << "Look-up table data = " << lookUpTable << std::endl;
+				}
+				info << "OpenMP stage times [ns]: histogram " << times[c].histogram << ", scan " << times[c].scan << ", LUT " << times[c].lut << ", back projection " << times[c].backProjection << std::endl;
+			}
+
+			if (verbosity == VERBOSITY_STATS) {
+				OpenMPTimes total;
+				for (const OpenMPTimes& channel : times) {
+					total.histogram += channel.histogram;
+					total.scan += channel.scan;
+					total.lut += channel.lut;
+					total.backProjection += channel.backProjection;
+				}
+				std::cout << GetImageStats(synthetic ? GetSyntheticName(synthetic_options) : image_filename, image_input.width(), image_input.height(), channels, total.histogram, total.scan, total.lut, total.backProjection);
+			}
+			info << "OpenMP threads " << GetOpenMPThreads() << std::endl;
+			info << "Image Size = " << image_input.size() << std::endl;
+
+			ShowResult(image_input, output_image, output_path, headless);
+			return 0;
+		}
+
 		//Part 2 - host operations
 		//2.1 Select computing devices
-		cl::Context context = GetContext(platform_id, device_id);
+		ScopedTimer context_timer("create context");
+		cl::Context context = multi_device ? GetPlatformContext(platform_id) : GetContext(platform_id, device_id);
 
 		//display the selected device
-		std::cout << "Runinng on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+		if (multi_device)
+			info << "Runinng on " << GetPlatformName(platform_id) << ", " << context.getInfo<CL_CONTEXT_NUM_DEVICES>() << " device(s)" << std::endl;
+		else
+			info << "Runinng on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
 
-		//create a queue to which we will push commands for the device
-		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+		context_timer.Stop();
 
 		//2.2 Load & build the device code
-		cl::Program::Sources sources;
+		//the source is embedded in the executable unless -kernels names a file (or the build had no pre-build step)
+		//compiled binaries are cached next to the kernel file, so only the first run pays for the compiler
+		bool cache_hit = false;
+		ScopedTimer build_timer("build program");
+		string kernel_source = GetKernelSource(kernel_file);
+		string kernel_cache = kernel_file.empty() ? KERNEL_FILE : kernel_file;
+		cl::Program program = BuildSourceCached(context, kernel_source, kernel_cache, GetDeviceBuildOptions(context), &cache_hit);
+		build_timer.Stop();
+		info << (cache_hit ? "Program loaded from binary cache" : "Program built from source");
+		info << ((kernel_file.empty() && HasEmbeddedKernels()) ? " (embedded kernels)" : "") << std::endl;
+
+		//2.3 Use the tuned launch configuration of the device, tuning it on the input image first if asked to
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		TuningProfile profile;
+		if (tune && !multi_device) {
+			CImg<unsigned char> calibration = load_input();
+			ScopedTimer timer("tune");
+			profile = Autotune(context, program, calibration, info);
+			SaveTuningProfile(TUNING_PROFILE_FILE, GetDeviceInfo(device).name, profile);
+		}
+		else if (!multi_device) {
+			ScopedTimer timer("load tuning profile");
+			if (LoadTuningProfile(TUNING_PROFILE_FILE, GetDeviceInfo(device).name, profile))
+				info << "Using tuned profile from " << TUNING_PROFILE_FILE << std::endl;
+		}
 
-		AddSources(sources, "kernels/my_kernels.cl");
+		//repeated, profiled runs over the requested image and local sizes
+		if (benchmark) {
+			CImg<unsigned char> image_input = load_input();
+			ScopedTimer timer("benchmark");
+			vector<BenchmarkRecord> records = RunBenchmark(context, program, image_input, benchmark_options);
+			string report = GetBenchmarkReport(records, benchmark_options, GetDeviceInfo(device).name);
+
+			//keep a CSV or JSON report on stdout machine readable
+			if (output_path.empty()) {
+				host_report.Disable();
+				std::cout << report;
+			}
+			else
+				ofstream(output_path) << report;
+			return 0;
+		}
 
-		cl::Program program(context, sources);
+		//differential check of every kernel variant, the exit code tells whether any of them failed
+		if (verify) {
+			ScopedTimer timer("verify");
+
+			//a generated image too large for 32-bit counts is streamed through the tiled path instead
+			if (synthetic && (size_t)synthetic_options.width * synthetic_options.height > VERIFY_STREAMED_SIZE) {
+				size_t max_alloc = GetDeviceInfo(device).maxAllocSize;
+				vector<VerificationResult> results(1, VerifyTiled(context, program, synthetic_options, tile_size ? tile_size : std::min(max_alloc, DEFAULT_TILE_SIZE)));
+				size_t failures = 0;
+				info << GetVerificationReport(results, failures);
+				return failures ? 1 : 0;
+			}
+
+			KernelVariantCache variants(context, kernel_source, kernel_cache);
+			vector<SyntheticImageOptions> images = synthetic ? vector<SyntheticImageOptions>(1, synthetic_options) : GetVerificationImages();
+			vector<VerificationResult> results;
+
+			for (const SyntheticImageOptions& options : images) {
+				vector<VerificationResult> image_results = VerifyKernels(context, variants, GenerateSyntheticImage(options), GetSyntheticName(options));
+				results.insert(results.end(), image_results.begin(), image_results.end());
+			}
+
+			size_t failures = 0;
+			info << GetVerificationReport(results, failures);
+			return failures ? 1 : 0;
+		}
 
-		//build and debug the kernel code
-		try {
-			program.build();
+		//compare the kernel variants built with -D options against the generic kernels
+		if (benchmark_specialization) {
+			CImg<unsigned char> image_input = load_input();
+			KernelVariantCache variants(context, kernel_source, kernel_cache);
+			ScopedTimer timer("benchmark specialization");
+			BenchmarkSpecialization(context, variants, image_input, info);
+			return 0;
 		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
+
+		//batch mode - overlap upload, compute and download of consecutive images
+		//or, with -threads, run whole images concurrently from worker threads with a queue each
+		if (!batch_path.empty()) {
+			//images are decoded, equalised and saved concurrently, so the batch is a single phase
+			ScopedTimer timer("batch");
+			ImageBatch batch(batch_path);
+			std::mutex stats_mutex;
+			auto save = [&](size_t index, const CImg<unsigned char>& output, const EqualizerEvents& events) {
+				if (!output_path.empty())
+					output.save((output_path + "/" + batch.Name(index)).c_str());
+
+				//worker threads finish images concurrently, each record is written as a whole line
+				if (verbosity == VERBOSITY_STATS) {
+					string record = GetImageStats(batch.Name(index), output, vector<EqualizerEvents>(1, events));
+					std::lock_guard<std::mutex> lock(stats_mutex);
+					std::cout << record;
+				}
+			};
+
+			if (threads > 0) {
+				BatchWorkers workers(context, program, threads, out_of_order, profile);
+				info << "Worker threads: " << threads << std::endl;
+				info << GetStreamReport(workers.Run(batch, save));
+				return 0;
+			}
+
+			//futures are collected oldest first, the host only blocks when the window of images in flight is full
+			if (async) {
+				AsyncEqualizer equalizer(context, program, out_of_order, profile);
+				std::deque<pair<std::future<CImg<unsigned char>>, EqualizerEvents>> in_flight;
+				StreamStats stats;
+				auto wall_start = std::chrono::high_resolution_clock::now();
+
+				auto collect = [&]() {
+					CImg<unsigned char> output = in_flight.front().first.get();
+					save(stats.images++, output, in_flight.front().second);
+					in_flight.pop_front();
+					stats.bytes += output.size();
+				};
+
+				for (size_t i = 0; i < batch.size(); i++) {
+					if (in_flight.size() == ASYNC_IN_FLIGHT)
+						collect();
+					EqualizerEvents events;
+					std::future<CImg<unsigned char>> result = equalizer.Submit(batch.Load(i), &events);
+					in_flight.push_back(make_pair(std::move(result), events));
+				}
+				while (!in_flight.empty())
+					collect();
+
+				stats.wall = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - wall_start).count();
+				info << "Images: " << stats.images << ", " << stats.bytes << " [B]" << std::endl;
+				info << "Throughput: " << stats.images / stats.wall << " images/s, " << stats.bytes / stats.wall / 1e6 << " MB/s" << std::endl;
+				return 0;
+			}
+
+			StreamPipeline pipeline(context, program, out_of_order, profile);
+			StreamStats stats = pipeline.Run(batch, save);
+
+			info << GetStreamReport(stats);
+			if (verbosity == VERBOSITY_DEBUG)
+				info << pipeline.GetPool().GetReport();
+			return 0;
+		}
+
+		//images larger than host memory never leave the files: row bands are read for the histogram pass,
+		//read again for the back projection pass and written out as they complete, so only four bands are held at a time
+		if (stream_input) {
+			ScopedTimer timer("stream");
+			PgmReader reader(image_filename);
+			const PgmHeader& header = reader.GetHeader();
+			PgmWriter writer(output_path.empty() ? "output.pgm" : output_path, header.width, header.height);
+
+			//whole rows per band, unless a single row is already larger than the device (or a 32-bit histogram) allows,
+			//in which case the bands are the largest allowed size and split rows, which the reader and writer handle
+			size_t max_band = std::min(std::min(tile_size ? tile_size : DEFAULT_TILE_SIZE, (size_t)GetDeviceInfo(device).maxAllocSize), MAX_TILE_SIZE);
+			size_t row = header.width;
+			size_t band_size = (row <= max_band) ? max_band / row * row : max_band;
+			TiledEqualizer tiled(context, program, band_size, profile);
+
+			//the tiled path counts in 64 bits, so files beyond 2^31 pixels are equalised exactly
+			TiledStats stats = tiled.Run(header.size(),
+				[&](size_t offset, size_t size, unsigned char* dst) { reader.Read(offset, size, dst); },
+				[&](size_t offset, size_t size, const unsigned char* src) { writer.Write(offset, size, src); });
+
+			if (verbosity == VERBOSITY_STATS)
+				std::cout << GetImageStats(image_filename, header.width, header.height, 1, stats.histogramPass, 0, 0, stats.projectionPass);
+			if (band_size % row == 0)
+				info << "Bands of " << band_size / row << " rows" << std::endl;
+			else
+				info << "Bands of " << band_size << " [B], rows wider than a band are split" << std::endl;
+			info << GetTiledReport(stats);
+			return 0;
+		}
+
+		//2.4 Load Image
+		//a binary PGM is mapped and the image shares the pixels of the mapping, so they are uploaded (or wrapped) straight from the file
+		MappedPgm mapped_input;
+		CImg<unsigned char> image_input;
+		ScopedTimer map_timer("map image");
+		if (!synthetic && map_input && mapped_input.Open(image_filename)) {
+			image_input.assign(mapped_input.data(), mapped_input.GetHeader().width, mapped_input.GetHeader().height, 1, 1, true);
+			map_timer.Stop();
+			info << "Mapped " << image_filename << std::endl;
+		}
+		else {
+			map_timer.Stop();
+			image_input = load_input();
+		}
+
+		//one image split across all devices of the platform, unless it is too large for their allocations
+		//(or for a 32-bit histogram), then it is tiled on the first device below
+		if (multi_device && image_input.size() > GetMultiDeviceCapacity(context))
+			info << "Image too large to split across devices, tiling it on " << GetDeviceInfo(device).name << std::endl;
+		else if (multi_device) {
+			ScopedTimer timer("multi-device run");
+			MultiDeviceEqualizer equalizer(context, program);
+			equalizer.Calibrate(image_input.data(), std::min(image_input.size(), CALIBRATION_SIZE));
+
+			CImg<unsigned char> output_image(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+			vector<DeviceSlice> slices = equalizer.Run(image_input.data(), output_image.data(), image_input.size());
+			timer.Stop();
+
+			if (verbosity == VERBOSITY_STATS) {
+				cl_ulong histogram = 0, back_projection = 0;
+				for (const DeviceSlice& slice : slices) {
+					histogram += slice.histogram;
+					back_projection += slice.backProjection;
+				}
+				std::cout << GetImageStats(synthetic ? GetSyntheticName(synthetic_options) : image_filename, image_input.width(), image_input.height(), 1, histogram, 0, 0, back_projection);
+			}
+			info << GetMultiDeviceReport(slices);
+
+			ShowResult(image_input, output_image, output_path, headless);
+			return 0;
+		}
+
+		//images larger than a single device allocation are streamed through fixed size tiles,
+		//as are images whose pixel count could overflow the 32-bit histogram of a single pass
+		size_t max_alloc = GetDeviceInfo(device).maxAllocSize;
+		if (tile_size || image_input.size() > max_alloc || image_input.size() > MAX_TILE_SIZE) {
+			if (!tile_size)
+				tile_size = std::min((size_t)max_alloc, DEFAULT_TILE_SIZE);
+
+			ScopedTimer timer("tiled run");
+			TiledEqualizer tiled(context, program, tile_size, profile);
+			CImg<unsigned char> output_image(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+
+			TiledStats stats = tiled.Run(image_input.size(),
+				[&](size_t offset, size_t size, unsigned char* dst) { memcpy(dst, image_input.data() + offset, size); },
+				[&](size_t offset, size_t size, const unsigned char* src) { memcpy(output_image.data() + offset, src, size); });
+			timer.Stop();
+
+			if (verbosity == VERBOSITY_STATS)
+				std::cout << GetImageStats(synthetic ? GetSyntheticName(synthetic_options) : image_filename, image_input.width(), image_input.height(), 1, stats.histogramPass, 0, 0, stats.projectionPass);
+			info << GetTiledReport(stats);
+
+			ShowResult(image_input, output_image, output_path, headless);
+			return 0;
 		}
 
-		typedef int mytype;
+		//create a queue to which we will push commands for the device
+		ScopedTimer queue_timer("create queue");
+		cl::CommandQueue queue(context, GetQueueProperties(context, out_of_order));
+
+		//colour channels are stored as separate planes, so each can be equalised as an independent branch of the task graph
+		int channels = per_channel ? image_input.spectrum() : 1;
+		size_t plane_size = image_input.size() / channels;
 
 		//Part 3 - memory allocation
-		std::vector<mytype> intensityHistogram(256);
-		std::vector<mytype> cumulativeHistogram(256);
-		std::vector<mytype> lookUpTable(256);
-
-		
-		int availableComputeUnits = CL_DEVICE_MAX_COMPUTE_UNITS;
-		size_t local_size = availableComputeUnits;
-
-		/*size_t padding_size = intensityHistogram.size() % local_size;*/
-
-		//if the input vector is not a multiple of the local_size
-		//insert additional neutral elements (0 for addition) so that the total will not be affected
-		//if (padding_size) {
-		//	// create an extra vector with neutral values
-		//	std::vector<int> A_ext(local_size-padding_size, 0);
-		//	// append that extra vector to our input
-		//	intensityHistogram.insert(intensityHistogram.end(), A_ext.begin(), A_ext.end());
-		//}
-
-		size_t input_elements = intensityHistogram.size();//number of input elements
-		size_t input_size = intensityHistogram.size()*sizeof(mytype);//size in bytes
-		size_t nr_groups = input_elements / local_size;
+		std::vector<std::vector<mytype>> intensityHistogram(channels, std::vector<mytype>(BIN_COUNT));
+		std::vector<std::vector<mytype>> cumulativeHistogram(channels, std::vector<mytype>(BIN_COUNT));
+		std::vector<std::vector<mytype>> lookUpTable(channels, std::vector<mytype>(BIN_COUNT));
+
+		cl_uint availableComputeUnits = GetDeviceInfo(device).computeUnits;
+
+		size_t input_size = BIN_COUNT*sizeof(mytype);//size in bytes
 		size_t elementsInput = image_input.size();
 
-		//device - buffers
-		cl::Buffer dev_image_input(context, CL_MEM_READ_ONLY, image_input.size());
-		cl::Buffer dev_image_output(context, CL_MEM_READ_WRITE, image_input.size()); //should be the same as input image
-		cl::Buffer bufferIntensityHistogram(context, CL_MEM_READ_WRITE, input_size);
-		cl::Buffer bufferCumulativeHistogram(context, CL_MEM_READ_WRITE, input_size);
-		cl::Buffer bufferLookUpTable(context, CL_MEM_READ_WRITE, input_size);
-		// complex hist required buffers, unimplemented as of this moment
-		cl::Buffer intermediateHistR(context, CL_MEM_WRITE_ONLY, input_size);
-		cl::Buffer intermediateHistG(context, CL_MEM_WRITE_ONLY, input_size);
-		cl::Buffer intermediateHistB(context, CL_MEM_WRITE_ONLY, input_size);
+		//zero-copy on devices sharing memory with the host: the image is placed once in page aligned memory
+		//that the device reads in place, and the output is mapped instead of copied back
+		bool zero_copy = (copy_mode == COPY_AUTO) ? HasUnifiedMemory(context) : (copy_mode == COPY_NEVER);
+		AlignedHostBuffer host_input;
+		AlignedHostBuffer host_output;
+		std::vector<void*> mapped_output(channels, (void*)NULL);
+
+		//a mapped input is already host memory the device can read in place, if its pixels happen to start on a page;
+		//otherwise it is copied to an aligned buffer like a decoded image, as runtimes would copy it anyway
+		unsigned char* zero_copy_input = (mapped_input.IsOpen() && IsPageAligned(mapped_input.data())) ? mapped_input.data() : NULL;
+		queue_timer.Stop();
+
+		if (zero_copy) {
+			host_output.Allocate(image_input.size());
+			if (!zero_copy_input) {
+				ScopedTimer timer("copy to host buffer");
+				host_input.Allocate(image_input.size());
+				memcpy(host_input.data(), image_input.data(), image_input.size());
+				image_input.assign(host_input.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum(), true);
+				zero_copy_input = host_input.data();
+			}
+		}
 
+		//device - buffers, copied planes come from the pool
+		ScopedTimer allocate_timer("allocate buffers");
+		BufferPool pool(context);
+		std::vector<EqualizerBuffers> buffers(channels);
+		for (int c = 0; c < channels; c++) {
+			if (zero_copy)
+				buffers[c].Wrap(context, plane_size, zero_copy_input + c*plane_size, host_output.data() + c*plane_size);
+			else
+				buffers[c].Reserve(pool, plane_size);
+		}
 
 		//Part 4 - device operations
-		
-		//4.1 copy array A to and initialise other arrays on device memory
-		queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, image_input.size(), &image_input.data()[0]);
-		// set zero values in output buffers
-		queue.enqueueFillBuffer(bufferIntensityHistogram, 0, 0, input_size);
-		queue.enqueueFillBuffer(bufferCumulativeHistogram, 0, 0, input_size);
-		queue.enqueueFillBuffer(bufferLookUpTable, 0, 0, input_size);
-
-		//4.2 Setup and execute all kernels (i.e. device code)
-
-		//colour_histogram_kernel(global const uint * data, global uint * binResultR, global uint * binResultG, global uint * binResultB, int elements_awaiting_process, int total_pixels)
-		
-		
-		cl::Kernel kernel_1 = cl::Kernel(program, "histLocalSimple");
-		//cl::Kernel kernel_1 = cl::Kernel(program, "histSimpleImplement");
-		// Set input
-		kernel_1.setArg(0, dev_image_input);
-		// Set output
-		kernel_1.setArg(1, bufferIntensityHistogram);
-		kernel_1.setArg(2, cl::Local(input_size));
-		kernel_1.setArg(3, int(intensityHistogram.size()));
-		
-		// unimplemented code below
-		//cl::Kernel kernel_1 = cl::Kernel(program, "colour_histogram_kernel");
-		//// Set input
-		//kernel_1.setArg(0, dev_image_input);
-		//kernel_1.setArg(1, intermediateHistR);
-		//kernel_1.setArg(2, intermediateHistG));
-		//kernel_1.setArg(3, intermediateHistB);
-		//kernel_1.setArg(4, cl::Local(local_size));
-		//kernel_1.setArg(5, cl::Local(local_size));
-		
-
-		cl::Kernel kernel_2 = cl::Kernel(program, "scan_add");
-		// Set input
-		kernel_2.setArg(0, bufferIntensityHistogram);
-		// Set output
-		kernel_2.setArg(1, bufferCumulativeHistogram);
-		// Allocate local memory
-		kernel_2.setArg(2, cl::Local(local_size));
-		kernel_2.setArg(3, cl::Local(local_size));
-		
-		cl::Kernel kernel_3 = cl::Kernel(program, "LUT");
-		// Set input
-		kernel_3.setArg(0, bufferCumulativeHistogram);
-		// Set output
-		kernel_3.setArg(1, bufferLookUpTable);
-
-		cl::Kernel kernel_4 = cl::Kernel(program, "backProjection");
-		// Set input
-		kernel_4.setArg(0, dev_image_input);
-		kernel_4.setArg(1, bufferLookUpTable);
-		// Set output
-		kernel_4.setArg(2, dev_image_output);
+		EqualizerKernels kernels(program, profile);
 
 		// create vector to store image
-		vector<unsigned char> output_image_buffer(image_input.size());
-
-		//call all kernels in a sequence and record time
-		cl::Event timeIHist;
-		queue.enqueueNDRangeKernel(kernel_1, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, &timeIHist);
-		queue.enqueueReadBuffer(bufferIntensityHistogram, CL_TRUE, 0, input_size, &intensityHistogram[0]);
-		cl::Event timeCumulativeHist;
-		queue.enqueueNDRangeKernel(kernel_2, cl::NullRange, cl::NDRange(input_size), cl::NullRange, NULL, &timeCumulativeHist);
-		queue.enqueueReadBuffer(bufferCumulativeHistogram, CL_TRUE, 0, input_size, &cumulativeHistogram[0]);
-		cl::Event timeLut;
-		queue.enqueueNDRangeKernel(kernel_3, cl::NullRange, cl::NDRange(input_size), cl::NullRange, NULL, &timeLut);
-		queue.enqueueReadBuffer(bufferLookUpTable, CL_TRUE, 0, input_size, &lookUpTable[0]);
-		cl::Event timeProjection;
-		queue.enqueueNDRangeKernel(kernel_4, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, &timeProjection);
-		queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, output_image_buffer.size(), &output_image_buffer.data()[0]);
+		vector<unsigned char> output_image_buffer(zero_copy ? 0 : image_input.size());
+
+		allocate_timer.Stop();
+
+		//record every command with its dependencies, the channels only meet again when the graph is waited on
+		ScopedTimer enqueue_timer("enqueue");
+		TaskGraph graph;
+		std::vector<EqualizerEvents> events(channels);
+
+		for (int c = 0; c < channels; c++) {
+			//4.1 copy the image plane to device memory, nothing to copy when the device reads host memory in place
+			vector<TaskGraph::Node> uploaded;
+			if (!zero_copy) {
+				uploaded.push_back(graph.Add("upload", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+					queue.enqueueWriteBuffer(buffers[c].imageInput, CL_FALSE, 0, plane_size, image_input.data() + c*plane_size, wait, done);
+				}));
+			}
+
+			//4.2 Setup and execute all kernels (i.e. device code)
+			TaskGraph::Node equalised = EnqueueEqualize(graph, queue, kernels, buffers[c], plane_size, uploaded, events[c]);
+
+			//intermediate results and the output plane are read back once the channel has been equalised
+			graph.Add("read histogram", { equalised }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				queue.enqueueReadBuffer(buffers[c].intensityHistogram, CL_FALSE, 0, input_size, &intensityHistogram[c][0], wait, done);
+			});
+			graph.Add("read cumulative histogram", { equalised }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				queue.enqueueReadBuffer(buffers[c].cumulativeHistogram, CL_FALSE, 0, input_size, &cumulativeHistogram[c][0], wait, done);
+			});
+			graph.Add("read LUT", { equalised }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				queue.enqueueReadBuffer(buffers[c].lookUpTable, CL_FALSE, 0, input_size, &lookUpTable[c][0], wait, done);
+			});
+			if (zero_copy) {
+				graph.Add("map output", { equalised }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+					mapped_output[c] = queue.enqueueMapBuffer(buffers[c].imageOutput, CL_FALSE, CL_MAP_READ, 0, plane_size, wait, done);
+				});
+			}
+			else {
+				graph.Add("download", { equalised }, [&](const vector<cl::Event>* wait, cl::Event* done) {
+					queue.enqueueReadBuffer(buffers[c].imageOutput, CL_FALSE, 0, plane_size, output_image_buffer.data() + c*plane_size, wait, done);
+				});
+			}
+		}
+
+		enqueue_timer.Stop();
+
+		//the host is idle from here until the device has finished, see the task graph report for where the time went
+		{
+			ScopedTimer timer("wait for device");
+			queue.flush();
+			graph.Wait();
+		}
 
 		//4.3 Results
-		std::cout << "Intensity Histogram Values : " << intensityHistogram << std::endl;
-		std::cout << "Histogram kernel execution time [ns]: " << timeIHist.getProfilingInfo<CL_PROFILING_COMMAND_END>() - timeIHist.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-		std::cout << GetFullProfilingInfo(timeIHist, ProfilingResolution::PROF_US) << endl;
-		cout << endl;
-
-		cout << endl;
-		std::cout << "Cumulative Histogram data = " << cumulativeHistogram << std::endl;
-		std::cout << "Cumulative Histogram execute time in nanoseconds : " << timeCumulativeHist.getProfilingInfo<CL_PROFILING_COMMAND_END>() - timeCumulativeHist.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-		std::cout << GetFullProfilingInfo(timeCumulativeHist, ProfilingResolution::PROF_US) << endl;
-		cout << endl;
-
-		cout << endl;
-		std::cout << "Look-up table data = " << lookUpTable << std::endl;
-		std::cout << "Look-up table execute time in nanoseconds : " << timeLut.getProfilingInfo<CL_PROFILING_COMMAND_END>() - timeLut.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-		std::cout << GetFullProfilingInfo(timeLut, ProfilingResolution::PROF_US) << endl;
-		cout << endl;
-
-		cout << endl;
-		std::cout << "Vector kernel execute time in nanoseconds : " << timeProjection.getProfilingInfo<CL_PROFILING_COMMAND_END>() - timeProjection.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-		std::cout << GetFullProfilingInfo(timeProjection, ProfilingResolution::PROF_US) << endl;
-		cout << endl;
-
-		cout << endl;
-		std::cout << "Preferred WG Size" << CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE << std::endl;
-		std::cout << "Actual WG Size" << availableComputeUnits << std::endl;
-		cout << endl;
-
-		std::cout << "Image Size = "<< elementsInput  << std::endl;
-		
-		CImg<unsigned char> output_image(output_image_buffer.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
-		CImgDisplay disp_output(output_image, "output");
-
-		while (!disp_input.is_closed() && !disp_output.is_closed()
-			&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
-			disp_input.wait(1);
-			disp_output.wait(1);
+		double peak_bandwidth = 0.0;
+		if (roofline) {
+			ScopedTimer timer("measure peak bandwidth");
+			peak_bandwidth = MeasurePeakBandwidth(context, program);
+		}
+
+		ScopedTimer print_timer("print results");
+		if (verbosity == VERBOSITY_STATS)
+			std::cout << GetImageStats(synthetic ? GetSyntheticName(synthetic_options) : image_filename, image_input, events);
+		else {
+			for (int c = 0; c < channels; c++) {
+				if (channels > 1)
+					info << "Channel " << c << std::endl;
+
+				if (verbosity == VERBOSITY_DEBUG)
+					info << "Intensity Histogram Values : " << intensityHistogram[c] << std::endl;
+				info << "Histogram kernel execution time [ns]: " << GetExecutionTime(events[c].histogram) << std::endl;
+				if (verbosity == VERBOSITY_DEBUG)
+					info << GetFullProfilingInfo(events[c].histogram, ProfilingResolution::PROF_US) << endl;
+				info << endl;
+
+				info << endl;
+				if (verbosity == VERBOSITY_DEBUG)
+					info << "Cumulative Histogram data = " << cumulativeHistogram[c] << std::endl;
+				info << "Cumulative Histogram execute time in nanoseconds : " << GetExecutionTime(events[c].scan) << std::endl;
+				if (verbosity == VERBOSITY_DEBUG)
+					info << GetFullProfilingInfo(events[c].scan, ProfilingResolution::PROF_US) << endl;
+				info << endl;
+
+				info << endl;
+				if (verbosity == VERBOSITY_DEBUG)
+					info << "Look-up table data = " << lookUpTable[c] << std::endl;
+				info << "Look-up table execute time in nanoseconds : " << GetExecutionTime(events[c].lut) << std::endl;
+				if (verbosity == VERBOSITY_DEBUG)
+					info << GetFullProfilingInfo(events[c].lut, ProfilingResolution::PROF_US) << endl;
+				info << endl;
+
+				info << endl;
+				info << "Vector kernel execute time in nanoseconds : " << GetExecutionTime(events[c].backProjection) << std::endl;
+				if (verbosity == VERBOSITY_DEBUG)
+					info << GetFullProfilingInfo(events[c].backProjection, ProfilingResolution::PROF_US) << endl;
+				info << endl;
+
+				//the roofline is reported at debug level or when its peak was measured (-roofline)
+				if (verbosity == VERBOSITY_DEBUG || roofline) {
+					info << GetRooflineReport(GetEqualizerTraffic(plane_size, events[c]), peak_bandwidth);
+					info << endl;
+				}
+			}
+
+			info << endl;
+			if (verbosity == VERBOSITY_DEBUG) {
+				info << "Task graph [us]:" << std::endl;
+				info << graph.GetReport(ProfilingResolution::PROF_US);
+				info << endl;
+			}
+			info << "Compute units " << availableComputeUnits << std::endl;
+			info << "Preferred WG Size multiple " << kernels.GetLimits(kernels.histogram, queue).multiple << std::endl;
+			if (kernels.IsTunedFor(kernels.histogramCoarse, queue, profile.histogram))
+				info << "Actual WG Size " << profile.histogram.localSize << ", coarsening " << profile.histogram.coarsening << std::endl;
+			else
+				info << "Actual WG Size " << kernels.GetLocalSize(kernels.histogram, queue) << " (default)" << std::endl;
+			info << endl;
+
+			info << "Image Size = "<< elementsInput  << std::endl;
+			info << (zero_copy ? "Zero-copy host buffers" : "Copied buffers") << std::endl;
+			if (verbosity == VERBOSITY_DEBUG)
+				info << pool.GetReport();
+		}
+		print_timer.Stop();
+
+		//zero-copy: CImg shares the mapped planes, which stay mapped until the image has been saved and shown
+		//the planes are contiguous when the runtime uses the host output in place, otherwise they are gathered into one image
+		ScopedTimer output_timer("copy output");
+		CImg<unsigned char> output_image;
+		if (zero_copy) {
+			bool contiguous = true;
+			for (int c = 0; c < channels; c++)
+				contiguous = contiguous && (mapped_output[c] == (unsigned char*)mapped_output[0] + c*plane_size);
+
+			if (contiguous)
+				output_image.assign((unsigned char*)mapped_output[0], image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum(), true);
+			else {
+				output_image.assign(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+				for (int c = 0; c < channels; c++)
+					memcpy(output_image.data() + c*plane_size, mapped_output[c], plane_size);
+			}
+		}
+		else
+			output_image.assign(output_image_buffer.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+		output_timer.Stop();
+
+		ShowResult(image_input, output_image, output_path, headless);
+
+		if (zero_copy) {
+			for (int c = 0; c < channels; c++) {
+				cl::Event unmapped;
+				queue.enqueueUnmapMemObject(buffers[c].imageOutput, mapped_output[c], NULL, &unmapped);
+				TaskGraph::Observe("unmap output", unmapped);
+			}
+			queue.finish();
 		}
 	}
 	catch (cl::Error err) {
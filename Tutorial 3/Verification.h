@@ -0,0 +1,393 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Equalizer.h"
+#include "Specialization.h"
+#include "SyntheticImage.h"
+#include "TiledEqualizer.h"
+
+//outcome of one kernel variant on one image, checked element by element against the host reference
+//the baseline is the host time of the same stage (CImg get_histogram/cumulate, BuildLookUpTable, a LUT loop),
+//and CImg get_equalize for whole pipelines
+struct VerificationResult {
+	string image;
+	string stage;
+	string variant;
+	size_t checked = 0;
+	size_t mismatches = 0;
+	size_t firstMismatch = 0;
+	long long expected = 0;
+	long long actual = 0;
+	double time = 0.0; //device [us]
+	double baseline = 0.0; //host [us]
+};
+
+//timed runs per variant and baseline, the fastest one is kept
+const int VERIFY_REPETITIONS = 3;
+
+//count the elements of 'actual' that differ from 'expected', remembering the first one
+template <typename T, typename U>
+void CompareResults(const T* expected, const U* actual, size_t count, VerificationResult& result) {
+	result.checked = count;
+	for (size_t i = 0; i < count; i++) {
+		if ((long long)expected[i] != (long long)actual[i]) {
+			if (!result.mismatches++) {
+				result.firstMismatch = i;
+				result.expected = (long long)expected[i];
+				result.actual = (long long)actual[i];
+			}
+		}
+	}
+}
+
+//fastest of VERIFY_REPETITIONS host runs [us]
+double TimeHost(const std::function<void()>& run) {
+	double best = 0.0;
+	for (int r = 0; r < VERIFY_REPETITIONS; r++) {
+		auto start = std::chrono::high_resolution_clock::now();
+		run();
+		double time = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+		best = r ? std::min(best, time) : time;
+	}
+	return best;
+}
+
+//fastest of VERIFY_REPETITIONS device runs [us], 'run' enqueues one run, waits for it and returns the kernel time [ns]
+double TimeDevice(const std::function<cl_ulong()>& run) {
+	double best = 0.0;
+	for (int r = 0; r < VERIFY_REPETITIONS; r++) {
+		double time = (double)run() / PROF_US;
+		best = r ? std::min(best, time) : time;
+	}
+	return best;
+}
+
+//images checked by default: every distribution at an odd size that no local size divides and at a tiny size that leaves
+//most work items of the first work group idle
+vector<SyntheticImageOptions> GetVerificationImages() {
+	vector<SyntheticImageOptions> images;
+
+	for (SyntheticDistribution distribution : { SYNTHETIC_UNIFORM, SYNTHETIC_SPIKE, SYNTHETIC_BIMODAL, SYNTHETIC_GRADIENT }) {
+		for (pair<int, int> size : { make_pair(37, 29), make_pair(1021, 683) }) {
+			SyntheticImageOptions options;
+			options.width = size.first;
+			options.height = size.second;
+			options.distribution = distribution;
+			images.push_back(options);
+		}
+	}
+
+	return images;
+}
+
+string GetSyntheticName(const SyntheticImageOptions& options) {
+	const char* names[] = { "uniform", "spike", "bimodal", "gradient" };
+	stringstream name;
+	name << options.width << "x" << options.height << "," << names[options.distribution] << (options.channels == 3 ? ",rgb" : "");
+	return name.str();
+}
+
+//run every histogram, scan, LUT and back projection kernel of my_kernels.cl that implements a stage of the pipeline,
+//plus whole pipelines, on 'image' and check each against the host reference
+//every stage gets the reference output of the previous stage as input, so a failure points at a single kernel
+vector<VerificationResult> VerifyKernels(const cl::Context& context, KernelVariantCache& variants, const CImg<unsigned char>& image, const string& image_name) {
+	cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+	size_t size = image.size();
+	size_t hist_size = BIN_COUNT * sizeof(mytype);
+	vector<VerificationResult> results;
+
+	//host reference
+	CImg<cimg_ulong> reference_histogram, reference_cumulative;
+	vector<mytype> histogram(BIN_COUNT), cumulative, lookUpTable;
+	vector<unsigned char> reference_output(size);
+
+	double histogram_baseline = TimeHost([&]() { reference_histogram = image.get_histogram(BIN_COUNT, 0, 255); });
+	double scan_baseline = TimeHost([&]() { reference_cumulative = reference_histogram.get_cumulate(); });
+	for (int i = 0; i < BIN_COUNT; i++)
+		histogram[i] = (mytype)reference_histogram[i];
+	double lut_baseline = TimeHost([&]() { BuildLookUpTable(histogram, cumulative, lookUpTable); });
+	double projection_baseline = TimeHost([&]() {
+		for (size_t i = 0; i < size; i++)
+			reference_output[i] = (unsigned char)lookUpTable[image[i]];
+	});
+	double equalize_baseline = TimeHost([&]() { image.get_equalize(BIN_COUNT, 0, 255); });
+
+	vector<mytype> exclusive(BIN_COUNT, 0);
+	for (int i = 1; i < BIN_COUNT; i++)
+		exclusive[i] = cumulative[i - 1];
+
+	EqualizerBuffers buffers;
+	buffers.Reserve(context, size);
+	queue.enqueueWriteBuffer(buffers.imageInput, CL_TRUE, 0, size, image.data());
+
+	auto add = [&](const string& stage, const string& variant, double time, double baseline) -> VerificationResult& {
+		VerificationResult result;
+		result.image = image_name;
+		result.stage = stage;
+		result.variant = variant;
+		result.time = time;
+		result.baseline = baseline;
+		results.push_back(result);
+		return results.back();
+	};
+
+	//the configurations exercised for each generic stage
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	vector<pair<string, EqualizerKernels>> configurations;
+	configurations.push_back(make_pair(string("default"), EqualizerKernels(variants.Get(KernelSpecialization()))));
+	for (size_t local_size : { 64, 256 }) {
+		EqualizerKernels& generic = configurations[0].second;
+		if (local_size > generic.GetLimits(generic.histogramCoarse, queue).maxSize ||
+			local_size > generic.GetLimits(generic.backProjectionCoarse, queue).maxSize)
+			continue;
+		for (int coarsening : { 1, 4, 16 }) {
+			TuningProfile profile;
+			profile.histogram.localSize = profile.backProjection.localSize = local_size;
+			profile.histogram.coarsening = profile.backProjection.coarsening = coarsening;
+			stringstream name;
+			name << "coarse local " << local_size << " x" << coarsening;
+			configurations.push_back(make_pair(name.str(), EqualizerKernels(variants.Get(KernelSpecialization()), profile)));
+		}
+	}
+	for (const KernelSpecialization& specialization : GetSpecializationCandidates(GetDeviceInfo(device)))
+		configurations.push_back(make_pair(specialization.GetBuildOptions(), EqualizerKernels(variants.Get(specialization), TuningProfile(), specialization)));
+
+	//histogram
+	vector<mytype> device_histogram(BIN_COUNT);
+	for (auto& configuration : configurations) {
+		EqualizerKernels& kernels = configuration.second;
+		string name = kernels.specialization.IsEnabled() ? "histSpecialized " : (kernels.profile.histogram.IsTuned() ? "histLocalCoarse " : "histLocalSimple ");
+		double time = TimeDevice([&]() {
+			TaskGraph graph;
+			TaskGraph::Node cleared = graph.Add("clear histogram", {}, [&](const vector<cl::Event>* wait, cl::Event* done) {
+				queue.enqueueFillBuffer(buffers.intensityHistogram, 0, 0, hist_size, wait, done);
+			});
+			TaskGraph::Node counted = EnqueueHistogram(graph, queue, kernels, buffers.imageInput, buffers.intensityHistogram, size, { cleared });
+			graph.Wait();
+			return GetExecutionTime(graph.GetEvent(counted));
+		});
+		queue.enqueueReadBuffer(buffers.intensityHistogram, CL_TRUE, 0, hist_size, &device_histogram[0]);
+		CompareResults(&histogram[0], &device_histogram[0], BIN_COUNT, add("histogram", name + configuration.first, time, histogram_baseline));
+	}
+
+	{
+		cl::Kernel kernel(variants.Get(KernelSpecialization()), "histSimpleImplement");
+		kernel.setArg(0, buffers.imageInput);
+		kernel.setArg(1, buffers.intensityHistogram);
+		double time = TimeDevice([&]() {
+			cl::Event cleared, evnt;
+			queue.enqueueFillBuffer(buffers.intensityHistogram, 0, 0, hist_size, NULL, &cleared);
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(size), cl::NullRange, NULL, &evnt);
+			TaskGraph::Observe("clear histogram", cleared);
+			TaskGraph::Observe("histSimpleImplement", evnt);
+			evnt.wait();
+			return GetExecutionTime(evnt);
+		});
+		queue.enqueueReadBuffer(buffers.intensityHistogram, CL_TRUE, 0, hist_size, &device_histogram[0]);
+		CompareResults(&histogram[0], &device_histogram[0], BIN_COUNT, add("histogram", "histSimpleImplement", time, histogram_baseline));
+	}
+
+	//scan, from the reference histogram
+	vector<mytype> device_cumulative(BIN_COUNT);
+	{
+		EqualizerKernels& kernels = configurations[0].second;
+		double time = TimeDevice([&]() {
+			queue.enqueueWriteBuffer(buffers.intensityHistogram, CL_FALSE, 0, hist_size, &histogram[0]);
+			TaskGraph graph;
+			TaskGraph::Node scanned = EnqueueScan(graph, queue, kernels, buffers, {});
+			graph.Wait();
+			return GetExecutionTime(graph.GetEvent(scanned));
+		});
+		queue.enqueueReadBuffer(buffers.cumulativeHistogram, CL_TRUE, 0, hist_size, &device_cumulative[0]);
+		CompareResults(&cumulative[0], &device_cumulative[0], BIN_COUNT, add("scan", "scan_add", time, scan_baseline));
+	}
+
+	//the fallback of EnqueueScan on devices with small work groups, checked on every device
+	{
+		cl::Kernel kernel(variants.Get(KernelSpecialization()), "scanSerial");
+		kernel.setArg(0, buffers.intensityHistogram);
+		kernel.setArg(1, buffers.cumulativeHistogram);
+		kernel.setArg(2, BIN_COUNT);
+		double time = TimeDevice([&]() {
+			cl::Event evnt;
+			queue.enqueueWriteBuffer(buffers.intensityHistogram, CL_FALSE, 0, hist_size, &histogram[0]);
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(1), cl::NDRange(1), NULL, &evnt);
+			TaskGraph::Observe("scanSerial", evnt);
+			evnt.wait();
+			return GetExecutionTime(evnt);
+		});
+		queue.enqueueReadBuffer(buffers.cumulativeHistogram, CL_TRUE, 0, hist_size, &device_cumulative[0]);
+		CompareResults(&cumulative[0], &device_cumulative[0], BIN_COUNT, add("scan", "scanSerial", time, scan_baseline));
+	}
+
+	//scan_hs and scan_bl work in place (scan_hs ends in A after an even number of steps), scan_bl is exclusive
+	//both run as one work group of BIN_COUNT work items, so they are skipped where that is not allowed
+	for (const char* name : { "scan_hs", "scan_bl" }) {
+		cl::Kernel kernel(variants.Get(KernelSpecialization()), name);
+		if (GetKernelLimits(kernel, queue).maxSize < (size_t)BIN_COUNT)
+			continue;
+		kernel.setArg(0, buffers.intensityHistogram);
+		if (string(name) == "scan_hs")
+			kernel.setArg(1, buffers.cumulativeHistogram);
+		double time = TimeDevice([&]() {
+			cl::Event evnt;
+			queue.enqueueWriteBuffer(buffers.intensityHistogram, CL_FALSE, 0, hist_size, &histogram[0]);
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(BIN_COUNT), cl::NDRange(BIN_COUNT), NULL, &evnt);
+			TaskGraph::Observe(name, evnt);
+			evnt.wait();
+			return GetExecutionTime(evnt);
+		});
+		queue.enqueueReadBuffer(buffers.intensityHistogram, CL_TRUE, 0, hist_size, &device_cumulative[0]);
+		const vector<mytype>& expected = (string(name) == "scan_bl") ? exclusive : cumulative;
+		CompareResults(&expected[0], &device_cumulative[0], BIN_COUNT, add("scan", name, time, scan_baseline));
+	}
+
+	//LUT and back projection, from the reference cumulative histogram and LUT
+	vector<unsigned char> lut_bytes(hist_size);
+	vector<unsigned char> device_output(size);
+	for (auto& configuration : configurations) {
+		EqualizerKernels& kernels = configuration.second;
+		bool uchar_lut = kernels.specialization.IsEnabled() && kernels.specialization.lutType == "uchar";
+		vector<unsigned char> reference_lut(lookUpTable.begin(), lookUpTable.end());
+
+		//the LUT kernel has no tunable launch, so it is only checked once per program
+		if (!kernels.profile.backProjection.IsTuned()) {
+			double time = TimeDevice([&]() {
+				queue.enqueueWriteBuffer(buffers.cumulativeHistogram, CL_FALSE, 0, hist_size, &cumulative[0]);
+				TaskGraph graph;
+				TaskGraph::Node built = EnqueueLookUpTable(graph, queue, kernels, buffers, {});
+				graph.Wait();
+				return GetExecutionTime(graph.GetEvent(built));
+			});
+			queue.enqueueReadBuffer(buffers.lookUpTable, CL_TRUE, 0, hist_size, &lut_bytes[0]);
+			VerificationResult& result = add("LUT", (kernels.specialization.IsEnabled() ? "lutSpecialized " : "LUT ") + configuration.first, time, lut_baseline);
+			if (uchar_lut)
+				CompareResults(&lookUpTable[0], &lut_bytes[0], BIN_COUNT, result);
+			else
+				CompareResults(&lookUpTable[0], (const mytype*)&lut_bytes[0], BIN_COUNT, result);
+		}
+
+		string name = kernels.specialization.IsEnabled() ? "backProjectionSpecialized " : (kernels.profile.backProjection.IsTuned() ? "backProjectionCoarse " : "backProjection ");
+		double time = TimeDevice([&]() {
+			if (uchar_lut)
+				queue.enqueueWriteBuffer(buffers.lookUpTable, CL_FALSE, 0, BIN_COUNT, &reference_lut[0]);
+			else
+				queue.enqueueWriteBuffer(buffers.lookUpTable, CL_FALSE, 0, hist_size, &lookUpTable[0]);
+			TaskGraph graph;
+			TaskGraph::Node projected = EnqueueBackProjection(graph, queue, kernels, buffers.imageInput, buffers.lookUpTable, buffers.imageOutput, size, {});
+			graph.Wait();
+			return GetExecutionTime(graph.GetEvent(projected));
+		});
+		queue.enqueueReadBuffer(buffers.imageOutput, CL_TRUE, 0, size, &device_output[0]);
+		CompareResults(&reference_output[0], &device_output[0], size, add("back projection", name + configuration.first, time, projection_baseline));
+	}
+
+	//whole pipelines against CImg's equalize(), the output is checked against the reference (CImg rounds differently)
+	for (auto& configuration : configurations) {
+		EqualizerKernels& kernels = configuration.second;
+		double time = TimeDevice([&]() {
+			TaskGraph graph;
+			EqualizerEvents events;
+			EnqueueEqualize(graph, queue, kernels, buffers, size, {}, events);
+			graph.Wait();
+			return GetExecutionTime(events.histogram) + GetExecutionTime(events.scan) + GetExecutionTime(events.lut) + GetExecutionTime(events.backProjection);
+		});
+		queue.enqueueReadBuffer(buffers.imageOutput, CL_TRUE, 0, size, &device_output[0]);
+		CompareResults(&reference_output[0], &device_output[0], size, add("equalize", configuration.first, time, equalize_baseline));
+	}
+
+	return results;
+}
+
+//one line per result, then the number of failures; speedup is baseline / device time
+//generated images with more pixels than this are verified by VerifyTiled, without ever being held in memory
+const size_t VERIFY_STREAMED_SIZE = INT_MAX;
+
+//stream the grayscale image of 'options' through TiledEqualizer in tiles of 'tile_size' and check every output pixel
+//against a host reference with 64-bit counts; above 2^31 pixels (e.g. 65536x32769,spike, where one bin alone
+//passes 2^31) this catches any counter of the tiled path that would wrap
+VerificationResult VerifyTiled(const cl::Context& context, const cl::Program& program, const SyntheticImageOptions& options, size_t tile_size) {
+	SyntheticImageOptions gray = options;
+	gray.channels = 1;
+	size_t size = (size_t)gray.width * gray.height;
+	auto pixel = [&](size_t index) { return GetSyntheticPixel(gray, (int)(index % gray.width), (int)(index / gray.width), 0); };
+
+	VerificationResult result;
+	result.image = GetSyntheticName(gray);
+	result.stage = "tiled";
+
+	vector<cl_ulong> histogram(BIN_COUNT, 0);
+	vector<unsigned char> lookUpTable;
+	size_t counted = 0;
+
+	TiledEqualizer tiled(context, program, tile_size);
+	TiledStats stats = tiled.Run(size,
+		[&](size_t offset, size_t count, unsigned char* dst) {
+			for (size_t i = 0; i < count; i++)
+				dst[i] = pixel(offset + i);
+
+			//pass 1 reads every tile once in order, the reference histogram is counted from it
+			if (offset == counted) {
+				for (size_t i = 0; i < count; i++)
+					histogram[dst[i]]++;
+				counted += count;
+			}
+		},
+		[&](size_t offset, size_t count, const unsigned char* src) {
+			if (lookUpTable.empty()) {
+				cl_ulong sum = 0;
+				for (int i = 0; i < BIN_COUNT; i++)
+					sum += histogram[i];
+
+				cl_ulong cumulative = 0;
+				for (int i = 0; i < BIN_COUNT; i++) {
+					cumulative += histogram[i];
+					lookUpTable.push_back(sum ? (unsigned char)(cumulative * 255.0 / sum) : 0);
+				}
+			}
+
+			for (size_t i = 0; i < count; i++) {
+				unsigned char expected = lookUpTable[pixel(offset + i)];
+				if (src[i] != expected && !result.mismatches++) {
+					result.firstMismatch = offset + i;
+					result.expected = expected;
+					result.actual = src[i];
+				}
+			}
+			result.checked += count;
+		});
+
+	stringstream variant;
+	variant << stats.tiles << " tiles of " << stats.tileSize << " [B]";
+	result.variant = variant.str();
+	result.time = (double)(stats.histogramPass + stats.projectionPass) / PROF_US;
+
+	return result;
+}
+
+string GetVerificationReport(const vector<VerificationResult>& results, size_t& failures) {
+	stringstream sstream;
+	failures = 0;
+
+	for (const VerificationResult& result : results) {
+		sstream << result.image << " " << result.stage << " " << result.variant << ": ";
+		if (result.mismatches) {
+			failures++;
+			sstream << "FAILED " << result.mismatches << " of " << result.checked << " differ, first at " << result.firstMismatch;
+			sstream << " (expected " << result.expected << ", got " << result.actual << ")";
+		}
+		else
+			sstream << "OK";
+		sstream << ", " << result.time << " [us], speedup " << (result.time > 0.0 ? result.baseline / result.time : 0.0) << endl;
+	}
+
+	sstream << results.size() << " checks, " << failures << " failed" << endl;
+
+	return sstream.str();
+}
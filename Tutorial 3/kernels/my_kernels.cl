@@ -62,30 +62,56 @@ kernel void histSimpleImplement(global const uchar* A, global int* H) {
 //	atomic_inc(&H[bin_index]);//serial operation, not very efficient!
 //}
 
-kernel void histLocalSimple(global const uchar* A, global int* H, local int* LH, int nr_bins) {
+//the global size is padded up to a whole number of work groups, work items past 'total_pixels' only help with the bins
+kernel void histLocalSimple(global const uchar* A, global int* H, local int* LH, int nr_bins, ulong total_pixels) {
 	size_t globalID = get_global_id(0);
 	size_t localID = get_local_id(0);
-	
-	//assumes that H has been initialised to 0
-	int bin_index = A[globalID];//take value as a bin index
+	size_t groupSize = get_local_size(0);
 
-	// set bin to 0
-	if (localID < nr_bins) {
-		LH[localID] = 0;
-	}
+	// set bins to 0, strided so that work groups smaller than nr_bins clear them all
+	for (size_t i = localID; i < nr_bins; i += groupSize)
+		LH[i] = 0;
 
 	barrier(CLK_LOCAL_MEM_FENCE);
-	atomic_inc(&LH[bin_index]);
-	barrier(CLK_LOCAL_MEM_FENCE);
+
+	//assumes that H has been initialised to 0
+	if (globalID < total_pixels)
+		atomic_inc(&LH[A[globalID]]);//take value as a bin index
 
 	// sync then combine privatised histograms
 	barrier(CLK_LOCAL_MEM_FENCE);
-	if(localID<nr_bins){
-		atomic_add(&H[localID], LH[localID]);
-	}
+	for (size_t i = localID; i < nr_bins; i += groupSize)
+		atomic_add(&H[i], LH[i]);
 }
 
 
+//coarsened version of histLocalSimple for tuned launches, each work item counts 'pixels_per_item' pixels
+//on every step consecutive work items read consecutive pixels, so the global reads stay coalesced
+//bins are cleared and merged with a strided loop, so any work group size works (not only >= nr_bins)
+kernel void histLocalCoarse(global const uchar* A, global int* H, local int* LH, int nr_bins, int pixels_per_item, ulong total_pixels) {
+	size_t localID = get_local_id(0);
+	size_t groupSize = get_local_size(0);
+	size_t index = get_group_id(0) * groupSize * pixels_per_item + localID;
+
+	for (size_t i = localID; i < nr_bins; i += groupSize)
+		LH[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// the tail of the last group is padding and must not be counted
+	for (int i = 0; i < pixels_per_item; i++, index += groupSize) {
+		if (index < total_pixels)
+			atomic_inc(&LH[A[index]]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (size_t i = localID; i < nr_bins; i += groupSize) {
+		if (LH[i])
+			atomic_add(&H[i], LH[i]);
+	}
+}
+
 // kernel to look at colour histograms
 # define BIN_SIZE 256
 void colour_histogram_kernel(global const uint* data, global uint* binResultR, global uint* binResultG, global uint* binResultB, int elements_awaiting_process, int total_pixels) {
@@ -207,6 +233,15 @@ kernel void scan_add(__global const int* A, global int* B, local int* scratch_1,
 	B[id] = scratch_1[lid];
 }
 
+//inclusive scan by a single work item, for devices whose work groups can not hold one work item per bin for scan_add
+kernel void scanSerial(global const int* A, global int* B, int nr_bins) {
+	int sum = 0;
+	for (int i = 0; i < nr_bins; i++) {
+		sum += A[i];
+		B[i] = sum;
+	}
+}
+
 //Blelloch basic exclusive scan
 kernel void scan_bl(global int* A) {
 	int id = get_global_id(0);
@@ -244,12 +279,132 @@ kernel void block_sum(global const int* A, global int* B, int local_size) {
 	B[id] = A[(id+1)*local_size-1];
 }
 
-kernel void LUT(global int* cumulativeHistogram, global int* lookupTable) {
+//cumulative * 255 / total as in the LUT kernels; devices without double precision are built with -DNO_FP64 and use
+//64-bit integers, which truncate to the same value for any count that fits the int histogram
+#ifdef NO_FP64
+#define SCALE_BIN(cumulative, total) ((total) ? (int)((ulong)(cumulative) * 255 / (ulong)(total)) : 0)
+#else
+#define SCALE_BIN(cumulative, total) ((cumulative) * (double)255 / (total))
+#endif
+
+kernel void LUT(global int* cumulativeHistogram, global int* lookupTable, int nr_bins) {
 	size_t globalID = get_global_id(0);
-	lookupTable[globalID] = cumulativeHistogram[globalID] * (double)255 / cumulativeHistogram[255];
+	if (globalID < nr_bins)
+		lookupTable[globalID] = SCALE_BIN(cumulativeHistogram[globalID], cumulativeHistogram[nr_bins - 1]);
 }
 
-kernel void backProjection(global uchar* A, global int* lookupTable, global uchar* B) {
+kernel void backProjection(global uchar* A, global int* lookupTable, global uchar* B, ulong total_pixels) {
 	size_t globalID = get_global_id(0);
-	B[globalID] = lookupTable[A[globalID]];
-}
\ No newline at end of file
+	if (globalID < total_pixels)
+		B[globalID] = lookupTable[A[globalID]];
+}
+
+//coarsened back projection for tuned launches, each work item maps 'pixels_per_item' pixels with the same coalesced pattern as histLocalCoarse
+kernel void backProjectionCoarse(global const uchar* A, global const int* lookupTable, global uchar* B, int pixels_per_item, ulong total_pixels) {
+	size_t groupSize = get_local_size(0);
+	size_t index = get_group_id(0) * groupSize * pixels_per_item + get_local_id(0);
+
+	for (int i = 0; i < pixels_per_item; i++, index += groupSize) {
+		if (index < total_pixels)
+			B[index] = lookupTable[A[index]];
+	}
+}
+
+//STREAM-style copy, measures the memory bandwidth a kernel can attain on the device (see Roofline.h)
+kernel void streamCopy(global const uint4* A, global uint4* B, ulong count) {
+	size_t id = get_global_id(0);
+	if (id < count)
+		B[id] = A[id];
+}
+
+#ifdef SPECIALIZED
+//variants built with every parameter fixed by -D options (see Specialization.h):
+//NR_BINS, COUNTER_T (int or uint), VECTOR_WIDTH (1, 2, 4, 8 or 16), REPLICATION and LUT_T
+//so local arrays are sized statically and the loops over them can be unrolled
+
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+
+//copies VECTOR_WIDTH pixels with a single vector load and store
+#if VECTOR_WIDTH > 1
+#define COPY_PIXELS(dst, src) CONCAT(vstore, VECTOR_WIDTH)(CONCAT(vload, VECTOR_WIDTH)(0, src), 0, dst)
+#else
+#define COPY_PIXELS(dst, src) (dst)[0] = (src)[0]
+#endif
+
+//each work item counts VECTOR_WIDTH consecutive pixels into one of REPLICATION copies of the local histogram,
+//neighbouring work items use different copies, so equal pixels do not all contend for the same counter
+kernel void histSpecialized(global const uchar* A, global COUNTER_T* H, ulong total_pixels) {
+	local COUNTER_T LH[NR_BINS * REPLICATION];
+	size_t localID = get_local_id(0);
+	size_t groupSize = get_local_size(0);
+	size_t index = get_global_id(0) * VECTOR_WIDTH;
+	local COUNTER_T* copy = LH + (localID % REPLICATION) * NR_BINS;
+
+	for (size_t i = localID; i < NR_BINS * REPLICATION; i += groupSize)
+		LH[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (index + VECTOR_WIDTH <= total_pixels) {
+		uchar pixels[VECTOR_WIDTH];
+		COPY_PIXELS(pixels, A + index);
+
+		#pragma unroll
+		for (int i = 0; i < VECTOR_WIDTH; i++)
+			atomic_inc(&copy[pixels[i]]);
+	}
+	else {
+		// the last partial vector of the image, padded work items skip it entirely
+		for (size_t i = index; i < total_pixels; i++)
+			atomic_inc(&copy[A[i]]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (size_t i = localID; i < NR_BINS; i += groupSize) {
+		COUNTER_T sum = 0;
+
+		#pragma unroll
+		for (int r = 0; r < REPLICATION; r++)
+			sum += LH[r * NR_BINS + i];
+
+		if (sum)
+			atomic_add(&H[i], sum);
+	}
+}
+
+kernel void lutSpecialized(global const int* cumulativeHistogram, global LUT_T* lookupTable) {
+	size_t globalID = get_global_id(0);
+	if (globalID < NR_BINS)
+		lookupTable[globalID] = (LUT_T)(SCALE_BIN(cumulativeHistogram[globalID], cumulativeHistogram[NR_BINS - 1]));
+}
+
+//the LUT is staged in local memory once per work group, then every work item maps VECTOR_WIDTH consecutive pixels
+kernel void backProjectionSpecialized(global const uchar* A, global const LUT_T* lookupTable, global uchar* B, ulong total_pixels) {
+	local LUT_T LL[NR_BINS];
+	size_t localID = get_local_id(0);
+	size_t groupSize = get_local_size(0);
+	size_t index = get_global_id(0) * VECTOR_WIDTH;
+
+	for (size_t i = localID; i < NR_BINS; i += groupSize)
+		LL[i] = lookupTable[i];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (index + VECTOR_WIDTH <= total_pixels) {
+		uchar pixels[VECTOR_WIDTH];
+		COPY_PIXELS(pixels, A + index);
+
+		#pragma unroll
+		for (int i = 0; i < VECTOR_WIDTH; i++)
+			pixels[i] = LL[pixels[i]];
+
+		COPY_PIXELS(B + index, pixels);
+	}
+	else {
+		for (size_t i = index; i < total_pixels; i++)
+			B[i] = LL[A[i]];
+	}
+}
+#endif
\ No newline at end of file
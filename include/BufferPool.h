@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "Utils.h"
+
+//smallest buffer handed out by BufferPool
+const size_t POOL_MIN_SIZE = 4096;
+
+//device buffers rounded up to size classes and recycled instead of freed
+//classes are spaced four to an octave (1, 1.25, 1.5, 1.75 x 2^n), so at most a quarter of a buffer is wasted
+//while images of similar sizes still land in the same class and reuse each other's buffers
+class BufferPool {
+public:
+	BufferPool(const cl::Context& context) :
+		context(context) {}
+
+	static size_t GetSizeClass(size_t size) {
+		if (size <= POOL_MIN_SIZE)
+			return POOL_MIN_SIZE;
+
+		size_t octave = 1;
+		while (octave <= size / 2)
+			octave *= 2;
+
+		return RoundUp(size, octave / 4);
+	}
+
+	//a free buffer of the size class of 'size' created with 'flags', allocated only when none is free
+	cl::Buffer Acquire(cl_mem_flags flags, size_t size) {
+		size_t size_class = GetSizeClass(size);
+		vector<cl::Buffer>& free_buffers = freeBuffers[make_pair(flags, size_class)];
+		cl::Buffer buffer;
+
+		requests++;
+		if (!free_buffers.empty()) {
+			buffer = free_buffers.back();
+			free_buffers.pop_back();
+		}
+		else {
+			buffer = cl::Buffer(context, flags, size_class);
+			allocations++;
+			allocated += size_class;
+			peakAllocated = std::max(peakAllocated, allocated);
+		}
+
+		inUse += size_class;
+		peakInUse = std::max(peakInUse, inUse);
+
+		return buffer;
+	}
+
+	//hand a buffer from Acquire back, commands still using it keep it alive until they complete
+	void Release(const cl::Buffer& buffer) {
+		if (!buffer())
+			return;
+
+		cl_mem_flags flags = buffer.getInfo<CL_MEM_FLAGS>();
+		size_t size = buffer.getInfo<CL_MEM_SIZE>();
+
+		freeBuffers[make_pair(flags, size)].push_back(buffer);
+		inUse -= size;
+	}
+
+	//free every buffer not currently acquired
+	void Trim() {
+		for (auto& entry : freeBuffers) {
+			allocated -= entry.first.second * entry.second.size();
+			entry.second.clear();
+		}
+	}
+
+	//peak: the most device memory ever held; steady state: what the pool holds now, after the working set has settled
+	string GetReport() const {
+		stringstream sstream;
+
+		sstream << "Device memory: peak " << peakAllocated << " [B] (" << peakInUse << " [B] in use), steady state " << allocated << " [B]" << endl;
+		sstream << "Buffer requests " << requests << ", allocations " << allocations << endl;
+
+		return sstream.str();
+	}
+
+private:
+	cl::Context context;
+	map<pair<cl_mem_flags, size_t>, vector<cl::Buffer>> freeBuffers;
+	size_t allocated = 0;
+	size_t peakAllocated = 0;
+	size_t inUse = 0;
+	size_t peakInUse = 0;
+	size_t requests = 0;
+	size_t allocations = 0;
+};
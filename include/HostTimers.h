@@ -0,0 +1,118 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+
+//start of the process as seen by the host timers, taken during static initialisation
+const std::chrono::high_resolution_clock::time_point HOST_PROCESS_START = std::chrono::high_resolution_clock::now();
+
+//wall time of named host phases accumulated over the run, in the order they first occurred
+//phases are expected not to overlap, so whatever they do not cover is reported as unattributed
+class HostProfile {
+public:
+	void Add(const string& name, double seconds) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (Phase& phase : phases) {
+			if (phase.name == name) {
+				phase.seconds += seconds;
+				phase.count++;
+				return;
+			}
+		}
+
+		Phase phase;
+		phase.name = name;
+		phase.seconds = seconds;
+		phase.count = 1;
+		phases.push_back(phase);
+	}
+
+	//one line per phase with its share of the time elapsed since the process started
+	string GetReport() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		stringstream sstream;
+		double elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - HOST_PROCESS_START).count();
+		double attributed = 0.0;
+
+		sstream << "Host phases [ms]:" << endl;
+		for (const Phase& phase : phases) {
+			sstream << phase.name << ": " << phase.seconds * 1e3;
+			if (phase.count > 1)
+				sstream << " in " << phase.count << " calls";
+			sstream << " (" << 100.0 * phase.seconds / elapsed << "%)" << endl;
+			attributed += phase.seconds;
+		}
+		sstream << "unattributed: " << (elapsed - attributed) * 1e3 << " (" << 100.0 * (elapsed - attributed) / elapsed << "%)" << endl;
+		sstream << "Since process start: " << elapsed * 1e3 << endl;
+
+		return sstream.str();
+	}
+
+private:
+	struct Phase {
+		string name;
+		double seconds = 0.0;
+		size_t count = 0;
+	};
+
+	vector<Phase> phases;
+	mutable std::mutex mutex;
+};
+
+//the profile every ScopedTimer adds to
+HostProfile& GetHostProfile() {
+	static HostProfile profile;
+	return profile;
+}
+
+//adds the time from construction to destruction (or Stop) to the phase 'name' of the host profile
+class ScopedTimer {
+public:
+	ScopedTimer(const string& name) :
+		name(name),
+		start(std::chrono::high_resolution_clock::now()) {}
+
+	~ScopedTimer() { Stop(); }
+
+	ScopedTimer(const ScopedTimer&) = delete;
+	ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+	//end the phase before the end of the scope
+	void Stop() {
+		if (stopped)
+			return;
+		stopped = true;
+		GetHostProfile().Add(name, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+	}
+
+private:
+	string name;
+	std::chrono::high_resolution_clock::time_point start;
+	bool stopped = false;
+};
+
+//prints the host profile to 'out' when it goes out of scope, so every way out of a run reports it
+class HostProfileReport {
+public:
+	HostProfileReport(std::ostream& out) :
+		out(&out) {}
+
+	~HostProfileReport() {
+		if (out)
+			*out << endl << GetHostProfile().GetReport();
+	}
+
+	HostProfileReport(const HostProfileReport&) = delete;
+	HostProfileReport& operator=(const HostProfileReport&) = delete;
+
+	//e.g. when stdout carries a machine readable report
+	void Disable() { out = NULL; }
+
+private:
+	std::ostream* out;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Utils.h"
+
+//64-bit FNV-1a hash, enough to tell kernel sources and cache keys apart
+cl_ulong HashString(const string& text) {
+	cl_ulong hash = 14695981039346656037ULL;
+	for (unsigned char c : text) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+//everything a compiled binary depends on: every device with its driver, the build options and the source
+string GetProgramCacheKey(const cl::Context& context, const string& source, const string& options) {
+	stringstream key;
+
+	for (const cl::Device& device : context.getInfo<CL_CONTEXT_DEVICES>()) {
+		const DeviceInfo& info = GetDeviceInfo(device);
+		key << info.name << "|" << info.driverVersion << "|" << info.version << "|";
+	}
+	key << options << "|" << hex << HashString(source);
+
+	return key.str();
+}
+
+//build the kernel source like BuildProgramFromSource, but reuse the device binaries of an earlier build when nothing they depend on has changed
+//binaries are stored next to 'file_name' as <file>.<hash of device names and options>.bin: the full key on the first line,
+//then per device the binary size and bytes; a missing, stale, truncated or rejected binary falls back to a source build
+//that replaces the file, so a driver or source change overwrites the old binaries instead of leaving them behind
+//(if the directory of 'file_name' does not exist the binaries are simply not cached)
+cl::Program BuildSourceCached(const cl::Context& context, const string& source, const string& file_name, const string& options = "", bool* cache_hit = NULL) {
+	vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+
+	string key = GetProgramCacheKey(context, source, options);
+	string slot = options;
+	for (const cl::Device& device : devices)
+		slot += "|" + GetDeviceInfo(device).name;
+	stringstream cache_name;
+	cache_name << file_name << "." << hex << HashString(slot) << ".bin";
+
+	if (cache_hit)
+		*cache_hit = false;
+
+	ifstream cache(cache_name.str(), ios::binary | ios::ate);
+	streamoff remaining = cache ? (streamoff)cache.tellg() : 0;
+	cache.seekg(0);
+	string cached_key;
+	if (cache && getline(cache, cached_key) && cached_key == key) {
+		cl::Program::Binaries binaries;
+		remaining -= (streamoff)cache.tellg();
+		for (size_t i = 0; i < devices.size() && cache; i++) {
+			//sizes are checked against what is left of the file, a truncated or corrupt file must not allocate
+			cl_ulong size = 0;
+			cache.read((char*)&size, sizeof(size));
+			remaining -= sizeof(size);
+			if (!cache || remaining < 0 || size > (cl_ulong)remaining)
+				break;
+			vector<unsigned char> binary((size_t)size);
+			cache.read((char*)binary.data(), size);
+			remaining -= (streamoff)size;
+			binaries.push_back(binary);
+		}
+
+		if (cache && binaries.size() == devices.size()) {
+			try {
+				cl::Program program(context, devices, binaries);
+				program.build(devices, options.c_str());
+				if (cache_hit)
+					*cache_hit = true;
+				return program;
+			}
+			catch (const cl::Error&) {
+				//binary rejected by the driver, rebuild from source below
+			}
+		}
+	}
+	cache.close();
+
+	cl::Program program = BuildProgramFromSource(context, source, options);
+
+	//written to a file of this process first and renamed into place, so a concurrent run never reads a partial file
+	cl::Program::Binaries binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+	stringstream temp_name;
+	temp_name << cache_name.str() << "." << hex << (std::hash<std::thread::id>()(std::this_thread::get_id()) ^ (size_t)std::chrono::high_resolution_clock::now().time_since_epoch().count()) << ".tmp";
+
+	ofstream output(temp_name.str(), ios::binary | ios::trunc);
+	output << key << '\n';
+	for (const vector<unsigned char>& binary : binaries) {
+		cl_ulong size = binary.size();
+		output.write((const char*)&size, sizeof(size));
+		output.write((const char*)binary.data(), binary.size());
+	}
+	output.close();
+
+	//rename does not replace an existing file on Windows
+	if (output) {
+		std::remove(cache_name.str().c_str());
+		if (std::rename(temp_name.str().c_str(), cache_name.str().c_str()) != 0)
+			std::remove(temp_name.str().c_str());
+	}
+	else
+		std::remove(temp_name.str().c_str());
+
+	return program;
+}
+
+//BuildSourceCached on the contents of the kernel file
+cl::Program BuildProgramCached(const cl::Context& context, const string& file_name, const string& options = "", bool* cache_hit = NULL) {
+	return BuildSourceCached(context, LoadSource(file_name), file_name, options, cache_hit);
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+
+//records enqueued commands as nodes of a dependency graph
+//each command waits only on the events of the nodes it depends on, instead of everything enqueued before it,
+//so on an out-of-order queue independent branches (colour channels, images of a batch) can run concurrently
+//on an in-order queue the same graph simply executes in submission order
+class TaskGraph {
+public:
+	typedef size_t Node;
+
+	//'enqueue' must pass the wait list and the event pointer it receives to the cl::CommandQueue call it makes
+	Node Add(const string& name, const vector<Node>& dependencies,
+		const std::function<void(const vector<cl::Event>* wait, cl::Event* done)>& enqueue) {
+		vector<cl::Event> wait;
+		for (Node dependency : dependencies)
+			wait.push_back(tasks[dependency].evnt);
+
+		Task task;
+		task.name = name;
+		task.dependencies = dependencies;
+		enqueue(wait.empty() ? NULL : &wait, &task.evnt);
+		tasks.push_back(task);
+		Observe(name, task.evnt);
+
+		return tasks.size() - 1;
+	}
+
+	//wrap an event produced outside of the graph (e.g. by another queue) so that nodes can depend on it
+	Node AddEvent(const string& name, const cl::Event& evnt) {
+		Task task;
+		task.name = name;
+		task.evnt = evnt;
+		tasks.push_back(task);
+
+		return tasks.size() - 1;
+	}
+
+	//process-wide hook called with every command added to any graph, from the thread adding it (see TraceRecorder.h)
+	static std::function<void(const string& name, const cl::Event& evnt)>& Observer() {
+		static std::function<void(const string& name, const cl::Event& evnt)> observer;
+		return observer;
+	}
+
+	//pass a command enqueued outside of any graph (a one-off launch, a final unmap) to the observer
+	static void Observe(const string& name, const cl::Event& evnt) {
+		if (Observer())
+			Observer()(name, evnt);
+	}
+
+	const cl::Event& GetEvent(Node node) const { return tasks[node].evnt; }
+
+	//block until every command of the graph has completed
+	void Wait() const {
+		vector<cl::Event> events;
+		for (const Task& task : tasks)
+			events.push_back(task.evnt);
+		if (!events.empty())
+			cl::Event::waitForEvents(events);
+	}
+
+	void Clear() { tasks.clear(); }
+
+	size_t size() const { return tasks.size(); }
+
+	//one line per node: start offset from the earliest node, execution time and dependencies
+	string GetReport(ProfilingResolution resolution) const {
+		stringstream sstream;
+
+		cl_ulong origin = ~(cl_ulong)0;
+		for (const Task& task : tasks)
+			origin = std::min(origin, task.evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+
+		for (size_t i = 0; i < tasks.size(); i++) {
+			sstream << i << " " << tasks[i].name;
+			sstream << ", Start " << (tasks[i].evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>() - origin) / resolution;
+			sstream << ", Executed " << GetExecutionTime(tasks[i].evnt) / resolution;
+			if (!tasks[i].dependencies.empty()) {
+				sstream << ", after";
+				for (Node dependency : tasks[i].dependencies)
+					sstream << " " << dependency;
+			}
+			sstream << endl;
+		}
+
+		return sstream.str();
+	}
+
+private:
+	struct Task {
+		string name;
+		cl::Event evnt;
+		vector<Node> dependencies;
+	};
+
+	vector<Task> tasks;
+};
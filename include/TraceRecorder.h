@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+#include "TaskGraph.h"
+#include "HostTimers.h"
+
+//collects the event of every command added to a TaskGraph (or passed to TaskGraph::Observe) while it exists, from any thread and any queue,
+//and writes them to 'file_name' in the Chrome trace event format when it goes out of scope
+//(open the file in chrome://tracing or ui.perfetto.dev): one process per device, one thread per command queue,
+//so gaps, overlaps between queues and stalls of the host feeding them are visible over a whole run
+//only one recorder can be attached at a time, an empty file name records nothing
+class TraceRecorder {
+public:
+	TraceRecorder(const string& file_name) :
+		fileName(file_name) {
+		if (!fileName.empty())
+			TaskGraph::Observer() = [this](const string& name, const cl::Event& evnt) { Record(name, evnt); };
+	}
+
+	~TraceRecorder() {
+		if (fileName.empty())
+			return;
+
+		TaskGraph::Observer() = nullptr;
+		ScopedTimer timer("write trace");
+		try {
+			ofstream(fileName) << GetChromeTrace();
+		}
+		catch (const cl::Error& err) {
+			std::cerr << "ERROR: trace not written, " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+		}
+	}
+
+	TraceRecorder(const TraceRecorder&) = delete;
+	TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+	void Record(const string& name, const cl::Event& evnt) {
+		std::lock_guard<std::mutex> lock(mutex);
+		commands.push_back(make_pair(name, evnt));
+	}
+
+	size_t size() const { return commands.size(); }
+
+	//complete ("X") events in microseconds from the earliest queued command, with the queued and submitted delays
+	//as arguments; every command must have completed
+	string GetChromeTrace() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		stringstream sstream;
+		map<cl_device_id, int> devices;
+		map<cl_command_queue, pair<int, int>> queues; //process and thread of each queue
+
+		cl_ulong origin = ~(cl_ulong)0;
+		for (const pair<string, cl::Event>& command : commands)
+			origin = std::min(origin, command.second.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>());
+
+		sstream << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [" << endl;
+		bool first = true;
+
+		for (const pair<string, cl::Event>& command : commands) {
+			const cl::Event& evnt = command.second;
+			cl::CommandQueue queue = evnt.getInfo<CL_EVENT_COMMAND_QUEUE>();
+
+			if (!queues.count(queue())) {
+				cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+				if (!devices.count(device()))
+					devices[device()] = (int)devices.size();
+				int pid = devices[device()];
+				int tid = (int)queues.size();
+				queues[queue()] = make_pair(pid, tid);
+
+				sstream << (first ? "" : ",\n") << "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": " << pid << ", \"args\": {\"name\": \"" << EscapeJson(GetDeviceInfo(device).name) << "\"}},\n";
+				sstream << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": " << pid << ", \"tid\": " << tid << ", \"args\": {\"name\": \"queue " << tid << "\"}}";
+				first = false;
+			}
+
+			cl_ulong queued = evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+			cl_ulong submitted = evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+			cl_ulong start = evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			cl_ulong end = evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+			sstream << (first ? "" : ",\n") << "{\"ph\": \"X\", \"name\": \"" << EscapeJson(command.first) << "\", \"cat\": \"" << GetCommandCategory(evnt.getInfo<CL_EVENT_COMMAND_TYPE>()) << "\"";
+			sstream << ", \"pid\": " << queues[queue()].first << ", \"tid\": " << queues[queue()].second;
+			sstream << ", \"ts\": " << (start - origin) / 1000.0 << ", \"dur\": " << (end - start) / 1000.0;
+			sstream << ", \"args\": {\"queued_us\": " << (submitted - queued) / 1000.0 << ", \"submitted_us\": " << (start - submitted) / 1000.0 << "}}";
+			first = false;
+		}
+
+		sstream << "\n]}" << endl;
+
+		return sstream.str();
+	}
+
+private:
+	static const char* GetCommandCategory(cl_command_type type) {
+		switch (type) {
+		case CL_COMMAND_NDRANGE_KERNEL: return "kernel";
+		case CL_COMMAND_WRITE_BUFFER: return "upload";
+		case CL_COMMAND_READ_BUFFER: return "download";
+		case CL_COMMAND_FILL_BUFFER: return "fill";
+		case CL_COMMAND_MAP_BUFFER: return "map";
+		case CL_COMMAND_UNMAP_MEM_OBJECT: return "unmap";
+		default: return "other";
+		}
+	}
+
+	string fileName;
+	vector<pair<string, cl::Event>> commands;
+	mutable std::mutex mutex;
+};
@@ -4,6 +4,10 @@
 #include <vector>
 #include <iostream>
 #include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <string>
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
@@ -24,18 +28,127 @@ ostream& operator<< (ostream& out, const vector<T>& v) {
 	return out;
 }
 
-string GetPlatformName(int platform_id) {
+//properties of a device, read once by the registry below so kernel and size choices do not query the runtime
+struct DeviceInfo {
+	cl::Device device;
+	string name;
+	string vendor;
+	string version;
+	string driverVersion;
+	string extensions;
+	cl_device_type type = 0;
+	cl_uint computeUnits = 0;
+	cl_uint clockFrequency = 0; //[MHz]
+	cl_ulong globalMemSize = 0;
+	cl_ulong localMemSize = 0;
+	cl_ulong maxAllocSize = 0;
+	size_t maxWorkGroupSize = 0;
+	cl_command_queue_properties queueProperties = 0;
+	bool hostUnifiedMemory = false;
+	bool fp64 = false;
+
+	bool HasExtension(const string& extension) const { return (" " + extensions + " ").find(" " + extension + " ") != string::npos; }
+
+	//whether the device reports OpenCL 'major'.'minor' or later ("OpenCL <major>.<minor> <vendor specific>")
+	bool IsVersionAtLeast(int major, int minor) const {
+		stringstream sstream(version);
+		string prefix;
+		int device_major = 0, device_minor = 0;
+		char dot = 0;
+		sstream >> prefix >> device_major >> dot >> device_minor;
+		return device_major > major || (device_major == major && device_minor >= minor);
+	}
+};
+
+struct PlatformInfo {
+	cl::Platform platform;
+	string name;
+	string version;
+	string vendor;
+	vector<DeviceInfo> devices;
+};
+
+//enumerating platforms and devices can take tens of milliseconds per call on some ICDs
+vector<PlatformInfo> EnumeratePlatforms() {
 	vector<cl::Platform> platforms;
 	cl::Platform::get(&platforms);
-	return platforms[platform_id].getInfo<CL_PLATFORM_NAME>();
+
+	vector<PlatformInfo> registry(platforms.size());
+	for (size_t i = 0; i < platforms.size(); i++) {
+		registry[i].platform = platforms[i];
+		registry[i].name = platforms[i].getInfo<CL_PLATFORM_NAME>();
+		registry[i].version = platforms[i].getInfo<CL_PLATFORM_VERSION>();
+		registry[i].vendor = platforms[i].getInfo<CL_PLATFORM_VENDOR>();
+
+		vector<cl::Device> devices;
+		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+
+		for (const cl::Device& device : devices) {
+			DeviceInfo info;
+			info.device = device;
+			info.name = device.getInfo<CL_DEVICE_NAME>();
+			info.vendor = device.getInfo<CL_DEVICE_VENDOR>();
+			info.version = device.getInfo<CL_DEVICE_VERSION>();
+			info.driverVersion = device.getInfo<CL_DRIVER_VERSION>();
+			info.extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+			info.type = device.getInfo<CL_DEVICE_TYPE>();
+			info.computeUnits = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+			info.clockFrequency = device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+			info.globalMemSize = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+			info.localMemSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+			info.maxAllocSize = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+			info.maxWorkGroupSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+			info.queueProperties = device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>();
+			info.hostUnifiedMemory = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() != CL_FALSE;
+			info.fp64 = info.HasExtension("cl_khr_fp64");
+			//CL_DEVICE_DOUBLE_FP_CONFIG is only defined from OpenCL 1.2 on, older runtimes may reject the query
+			if (!info.fp64 && info.IsVersionAtLeast(1, 2)) {
+				try {
+					info.fp64 = device.getInfo<CL_DEVICE_DOUBLE_FP_CONFIG>() != 0;
+				}
+				catch (const cl::Error&) {}
+			}
+			registry[i].devices.push_back(info);
+		}
+	}
+
+	return registry;
+}
+
+//every platform with its devices, enumerated on the first call only; safe to call from any thread
+//(a failed enumeration throws and is retried by the next call)
+const vector<PlatformInfo>& GetPlatforms() {
+	static const vector<PlatformInfo> registry = EnumeratePlatforms();
+	return registry;
+}
+
+//registry entry of a device obtained from a context or a queue
+const DeviceInfo& GetDeviceInfo(const cl::Device& device) {
+	for (const PlatformInfo& platform : GetPlatforms())
+		for (const DeviceInfo& info : platform.devices)
+			if (info.device() == device())
+				return info;
+
+	throw cl::Error(CL_INVALID_DEVICE, "GetDeviceInfo");
+}
+
+//empty for an unknown platform or device, like GetContext
+string GetPlatformName(int platform_id) {
+	const vector<PlatformInfo>& platforms = GetPlatforms();
+
+	if ((platform_id >= 0) && (platform_id < (int)platforms.size()))
+		return platforms[platform_id].name;
+
+	return "";
 }
 
 string GetDeviceName(int platform_id, int device_id) {
-	vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
-	vector<cl::Device> devices;
-	platforms[platform_id].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
-	return devices[device_id].getInfo<CL_DEVICE_NAME>();
+	const vector<PlatformInfo>& platforms = GetPlatforms();
+
+	if ((platform_id >= 0) && (platform_id < (int)platforms.size()) && (device_id >= 0) && (device_id < (int)platforms[platform_id].devices.size()))
+		return platforms[platform_id].devices[device_id].name;
+
+	return "";
 }
 
 const char *getErrorString(cl_int error) {
@@ -121,41 +234,68 @@ void CheckError(cl_int error) {
 	}
 }
 
+//contents of a kernel file, a missing or unreadable file is reported and raised as an OpenCL error
+string LoadSource(const string& file_name) {
+	ifstream file(file_name, ios::binary);
+	if (!file) {
+		std::cerr << "Can not open kernel file " << file_name << std::endl;
+		throw cl::Error(CL_INVALID_VALUE, "LoadSource");
+	}
+
+	return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
 void AddSources(cl::Program::Sources& sources, const string& file_name) {
-	//TODO: add file existence check
-	ifstream file(file_name);
-	string* source_code = new string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>()));
-	sources.push_back((*source_code).c_str());
+	sources.push_back(LoadSource(file_name));
+}
+
+//build the kernel source for all devices of the context, printing the build log on failure
+cl::Program BuildProgramFromSource(const cl::Context& context, const string& source, const string& options = "") {
+	cl::Program program(context, source);
+
+	//build and debug the kernel code
+	try {
+		program.build(options.c_str());
+	}
+	catch (const cl::Error& err) {
+		std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+		std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+		std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+		throw err;
+	}
+
+	return program;
+}
+
+//load the kernel file and build it like BuildProgramFromSource
+cl::Program BuildProgram(const cl::Context& context, const string& file_name, const string& options = "") {
+	return BuildProgramFromSource(context, LoadSource(file_name), options);
 }
 
 string ListPlatformsDevices() {
 
 	stringstream sstream;
-	vector<cl::Platform> platforms;
-
-	cl::Platform::get(&platforms);
+	const vector<PlatformInfo>& platforms = GetPlatforms();
 
 	sstream << "Found " << platforms.size() << " platform(s):" << endl;
 
 	for (unsigned int i = 0; i < platforms.size(); i++)
 	{
-		sstream << "\nPlatform " << i << ", " << platforms[i].getInfo<CL_PLATFORM_NAME>() << ", version: " << platforms[i].getInfo<CL_PLATFORM_VERSION>();
+		sstream << "\nPlatform " << i << ", " << platforms[i].name << ", version: " << platforms[i].version;
 
-		sstream << ", vendor: " << platforms[i].getInfo<CL_PLATFORM_VENDOR>() << endl;
+		sstream << ", vendor: " << platforms[i].vendor << endl;
 		//		sstream << ", extensions: " << platforms[i].getInfo<CL_PLATFORM_EXTENSIONS>() << endl;
 
-		vector<cl::Device> devices;
-
-		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+		const vector<DeviceInfo>& devices = platforms[i].devices;
 
 		sstream << "\n   Found " << devices.size() << " device(s):" << endl;
 
 		for (unsigned int j = 0; j < devices.size(); j++)
 		{
-			sstream << "\n      Device " << j << ", " << devices[j].getInfo<CL_DEVICE_NAME>() << ", version: " << devices[j].getInfo<CL_DEVICE_VERSION>();
+			sstream << "\n      Device " << j << ", " << devices[j].name << ", version: " << devices[j].version;
 
-			sstream << ", vendor: " << devices[j].getInfo<CL_DEVICE_VENDOR>();
-			cl_device_type device_type = devices[j].getInfo<CL_DEVICE_TYPE>();
+			sstream << ", vendor: " << devices[j].vendor;
+			cl_device_type device_type = devices[j].type;
 			sstream << ", type: ";
 			if (device_type & CL_DEVICE_TYPE_DEFAULT)
 				sstream << "DEFAULT ";
@@ -165,10 +305,12 @@ string ListPlatformsDevices() {
 				sstream << "GPU ";
 			if (device_type & CL_DEVICE_TYPE_ACCELERATOR)
 				sstream << "ACCELERATOR ";
-			sstream << ", compute units: " << devices[j].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
-			sstream << ", clock freq [MHz]: " << devices[j].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
-			sstream << ", max memory size [B]: " << devices[j].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
-			sstream << ", max allocatable memory [B]: " << devices[j].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+			sstream << ", compute units: " << devices[j].computeUnits;
+			sstream << ", clock freq [MHz]: " << devices[j].clockFrequency;
+			sstream << ", max memory size [B]: " << devices[j].globalMemSize;
+			sstream << ", max allocatable memory [B]: " << devices[j].maxAllocSize;
+			sstream << ", local memory [B]: " << devices[j].localMemSize;
+			sstream << ", fp64: " << (devices[j].fp64 ? "yes" : "no");
 
 			sstream << endl;
 		}
@@ -179,23 +321,133 @@ string ListPlatformsDevices() {
 }
 
 cl::Context GetContext(int platform_id, int device_id) {
-	vector<cl::Platform> platforms;
+	const vector<PlatformInfo>& platforms = GetPlatforms();
 
-	cl::Platform::get(&platforms);
+	if ((platform_id >= 0) && (platform_id < (int)platforms.size()) && (device_id >= 0) && (device_id < (int)platforms[platform_id].devices.size()))
+		return cl::Context({ platforms[platform_id].devices[device_id].device });
 
-	for (unsigned int i = 0; i < platforms.size(); i++)
-	{
-		vector<cl::Device> devices;
-		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+	return cl::Context();
+}
 
-		for (unsigned int j = 0; j < devices.size(); j++)
-		{
-			if ((i == platform_id) && (j == device_id))
-				return cl::Context({ devices[j] });
+//context spanning every device of the platform, for work split across devices
+cl::Context GetPlatformContext(int platform_id) {
+	const vector<PlatformInfo>& platforms = GetPlatforms();
+
+	if ((platform_id < 0) || (platform_id >= (int)platforms.size()) || platforms[platform_id].devices.empty())
+		return cl::Context();
+
+	vector<cl::Device> devices;
+	for (const DeviceInfo& info : platforms[platform_id].devices)
+		devices.push_back(info.device);
+
+	return cl::Context(devices);
+}
+
+//queue properties with profiling enabled, out-of-order execution is added only if every device of the context supports it
+cl_command_queue_properties GetQueueProperties(const cl::Context& context, bool out_of_order) {
+	cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
+
+	if (out_of_order) {
+		bool supported = true;
+		for (const cl::Device& device : context.getInfo<CL_CONTEXT_DEVICES>())
+			supported = supported && (GetDeviceInfo(device).queueProperties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+
+		if (supported)
+			properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+		else
+			cerr << "Out-of-order queues not supported by the device, using an in-order queue" << endl;
+	}
+
+	return properties;
+}
+
+//build options the kernels need on the devices of the context: -DNO_FP64 if any of them lacks double precision,
+//which switches the LUT kernels to integer arithmetic
+string GetDeviceBuildOptions(const cl::Context& context) {
+	for (const cl::Device& device : context.getInfo<CL_CONTEXT_DEVICES>())
+		if (!GetDeviceInfo(device).fp64)
+			return "-DNO_FP64";
+
+	return "";
+}
+
+//true if every device of the context shares physical memory with the host (CPU devices, integrated GPUs)
+//transfers to such devices are plain memcpys that mapping host memory avoids
+bool HasUnifiedMemory(const cl::Context& context) {
+	for (const cl::Device& device : context.getInfo<CL_CONTEXT_DEVICES>())
+		if (!GetDeviceInfo(device).hostUnifiedMemory)
+			return false;
+
+	return true;
+}
+
+//alignment and size granularity runtimes require before they use a CL_MEM_USE_HOST_PTR allocation in place
+const size_t HOST_PAGE_SIZE = 4096;
+
+bool IsPageAligned(const void* ptr) {
+	return ((uintptr_t)ptr % HOST_PAGE_SIZE) == 0;
+}
+
+//page aligned host memory, rounded up to whole pages
+class AlignedHostBuffer {
+public:
+	AlignedHostBuffer() : ptr(NULL), bytes(0) {}
+
+	explicit AlignedHostBuffer(size_t size) : ptr(NULL), bytes(0) { Allocate(size); }
+
+	~AlignedHostBuffer() { Free(); }
+
+	void Allocate(size_t size) {
+		Free();
+		bytes = ((size + HOST_PAGE_SIZE - 1) / HOST_PAGE_SIZE) * HOST_PAGE_SIZE;
+#ifdef _WIN32
+		ptr = (unsigned char*)_aligned_malloc(bytes, HOST_PAGE_SIZE);
+#else
+		void* allocation = NULL;
+		ptr = (posix_memalign(&allocation, HOST_PAGE_SIZE, bytes) == 0) ? (unsigned char*)allocation : NULL;
+#endif
+		if (!ptr) {
+			bytes = 0;
+			throw std::bad_alloc();
 		}
 	}
 
-	return cl::Context();
+	void Free() {
+#ifdef _WIN32
+		_aligned_free(ptr);
+#else
+		free(ptr);
+#endif
+		ptr = NULL;
+		bytes = 0;
+	}
+
+	unsigned char* data() const { return ptr; }
+	size_t size() const { return bytes; }
+
+private:
+	AlignedHostBuffer(const AlignedHostBuffer&);
+	AlignedHostBuffer& operator=(const AlignedHostBuffer&);
+
+	unsigned char* ptr;
+	size_t bytes;
+};
+
+//smallest multiple of 'multiple' not below 'value', used to pad global sizes to whole work groups
+size_t RoundUp(size_t value, size_t multiple) {
+	return ((value + multiple - 1) / multiple) * multiple;
+}
+
+//'text' as the contents of a JSON string (quotes and backslashes escaped), for names in machine readable reports
+string EscapeJson(const string& text) {
+	string escaped;
+	for (char c : text) {
+		if (c == '"' || c == '\\')
+			escaped += '\\';
+		escaped += c;
+	}
+
+	return escaped;
 }
 
 enum ProfilingResolution {
@@ -205,6 +457,11 @@ enum ProfilingResolution {
 	PROF_S = 1000000000
 };
 
+//execution time of a command in nanoseconds, the queue must have profiling enabled
+cl_ulong GetExecutionTime(const cl::Event& evnt) {
+	return evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+}
+
 string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolution) {
 	stringstream sstream;
 